@@ -0,0 +1,283 @@
+#include "binary_database.h"
+
+#include <string.h>
+
+#include <iostream>
+#include <fstream>
+#include <thread>
+
+// ----------------------------------------------------------------------------------------------------
+
+bool isBinaryDatabase(const char* data, std::size_t size)
+{
+    return size >= sizeof(BINARY_DATABASE_MAGIC) && memcmp(data, BINARY_DATABASE_MAGIC, sizeof(BINARY_DATABASE_MAGIC)) == 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Splits a section of null-terminated strings. Returns false if the last one is not terminated.
+bool readStrings(const char* data, std::size_t size, std::vector<std::string>& strings)
+{
+    const char* end = data + size;
+    while(data < end)
+    {
+        const char* null = (const char*)memchr(data, '\0', end - data);
+        if (!null)
+            return false;
+
+        strings.push_back(std::string(data, null - data));
+        data = null + 1;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool loadBinaryDatabase(const char* data, std::size_t size, const std::string& filename, PhotoDatabase& db)
+{
+    BinaryHeader header;
+    if (size < sizeof(header))
+    {
+        std::cout << "Damaged database file " << filename << std::endl;
+        return false;
+    }
+
+    memcpy(&header, data, sizeof(header));
+    if (header.version != BINARY_DATABASE_VERSION || header.num_sections != NUM_SECTIONS)
+    {
+        std::cout << filename << " was written by another version, convert it to text with that version first"
+                  << std::endl;
+        return false;
+    }
+
+    const char* sections[NUM_SECTIONS];
+    for(unsigned int s = 0; s < NUM_SECTIONS; ++s)
+    {
+        uint64_t offset = header.sections[s].offset;
+        if (offset % 8 != 0 || offset > size || header.sections[s].size > size - offset)
+        {
+            std::cout << "Damaged database file " << filename << std::endl;
+            return false;
+        }
+
+        sections[s] = data + offset;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Read everything into a batch first, such that a damaged file leaves the database as it is
+
+    std::vector<std::string> concepts;
+    std::vector<std::string> dirs;
+    PhotoBatch batch;
+
+    const BinaryPhotoRecord* records = (const BinaryPhotoRecord*)sections[SECTION_PHOTOS];
+    std::size_t n_photos = header.sections[SECTION_PHOTOS].size / sizeof(BinaryPhotoRecord);
+
+    const uint32_t* tags = (const uint32_t*)sections[SECTION_TAGS];
+    std::size_t n_tags = header.sections[SECTION_TAGS].size / sizeof(uint32_t);
+
+    std::size_t arena_size = header.sections[SECTION_ARENA].size;
+
+    bool ok = readStrings(sections[SECTION_CONCEPTS], header.sections[SECTION_CONCEPTS].size, concepts) &&
+              readStrings(sections[SECTION_DIRECTORIES], header.sections[SECTION_DIRECTORIES].size, dirs) &&
+              batch.filenames.assign(dirs, sections[SECTION_ARENA], arena_size);
+
+    Id first_id = db.photos().size();
+
+    for(std::size_t i = 0; ok && i < n_photos; ++i)
+    {
+        const BinaryPhotoRecord& r = records[i];
+        if (r.dir >= dirs.size() || r.name >= arena_size || r.tags_begin > n_tags || r.num_tags > n_tags - r.tags_begin)
+        {
+            ok = false;
+            break;
+        }
+
+        PhotoData* p = &batch.photos.push_back(PhotoData(first_id + i));
+
+        memcpy(p->md5sum.bytes, r.md5sum, sizeof(r.md5sum));
+        p->filename.dir = r.dir;
+        p->filename.name = r.name;
+        p->stat.size = r.size;
+        p->stat.mtime = r.mtime;
+        p->stat.device = r.device;
+        p->stat.inode = r.inode;
+        p->fingerprint = r.fingerprint;
+        p->perceptual_hash = r.perceptual_hash;
+        p->has_perceptual_hash = (r.flags & PHOTO_FLAG_PERCEPTUAL_HASH) != 0;
+        p->setDone(r.flags & PHOTO_FLAG_DONE);
+
+        for(uint32_t t = 0; t < r.num_tags; ++t)
+            batch.addPhotoTag(p, tags[r.tags_begin + t]);
+    }
+
+    const BinaryDuplicateRecord* duplicates = (const BinaryDuplicateRecord*)sections[SECTION_DUPLICATES];
+    std::size_t n_duplicates = header.sections[SECTION_DUPLICATES].size / sizeof(BinaryDuplicateRecord);
+
+    std::vector<std::string> duplicate_names;
+    ok = ok && readStrings(sections[SECTION_DUPLICATE_NAMES], header.sections[SECTION_DUPLICATE_NAMES].size,
+                           duplicate_names) && duplicate_names.size() == n_duplicates;
+
+    for(std::size_t i = 0; ok && i < n_duplicates; ++i)
+        ok = duplicates[i].photo < n_photos;
+
+    if (!ok)
+    {
+        std::cout << "Damaged database file " << filename << std::endl;
+        return false;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Add to the database
+
+    for(Id id = 0; id < concepts.size(); ++id)
+    {
+        if (!concepts[id].empty())
+            db.addConcept(concepts[id], id);
+    }
+
+    // The saved indexes are only valid if the photos and filenames keep their ids
+    bool keep_ids = db.photos().empty() && db.filenames().numDirectories() == 1;
+
+    db.appendPhotos(batch);
+
+    keep_ids = keep_ids && db.filenames().numDirectories() == dirs.size();
+    if (!keep_ids || !db.restoreIndexes((const HashSlot*)sections[SECTION_MD5SUM_INDEX],
+                                        header.sections[SECTION_MD5SUM_INDEX].size / sizeof(HashSlot),
+                                        (const HashSlot*)sections[SECTION_FILENAME_INDEX],
+                                        header.sections[SECTION_FILENAME_INDEX].size / sizeof(HashSlot)))
+    {
+        db.rebuildIndexes(std::max(1u, std::thread::hardware_concurrency()));
+    }
+
+    for(std::size_t i = 0; i < n_duplicates; ++i)
+    {
+        const BinaryDuplicateRecord& r = duplicates[i];
+
+        KnownDuplicate d;
+        memcpy(d.md5sum.bytes, r.md5sum, sizeof(r.md5sum));
+        d.photo = first_id + r.photo;
+        d.stat.size = r.size;
+        d.stat.mtime = r.mtime;
+        d.stat.device = r.device;
+        d.stat.inode = r.inode;
+        db.setDuplicate(duplicate_names[i], d);
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void writeSection(std::ofstream& fout, BinaryHeader& header, BinarySection section, const void* data, std::size_t size)
+{
+    static const char padding[8] = { 0 };
+
+    std::size_t offset = fout.tellp();
+    if (offset % 8 != 0)
+    {
+        fout.write(padding, 8 - offset % 8);
+        offset += 8 - offset % 8;
+    }
+
+    fout.write((const char*)data, size);
+
+    header.sections[section].offset = offset;
+    header.sections[section].size = size;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool writeBinaryDatabase(const PhotoDatabase& db, const std::string& filename)
+{
+    std::ofstream fout(filename.c_str(), std::ios::binary);
+
+    BinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_DATABASE_MAGIC, sizeof(header.magic));
+    header.version = BINARY_DATABASE_VERSION;
+    header.num_sections = NUM_SECTIONS;
+
+    // The header is written again once the sections are in place
+    fout.write((const char*)&header, sizeof(header));
+
+    std::string strings;
+    for(const std::string& concept : db.concepts())
+        strings.append(concept.c_str(), concept.size() + 1);
+    writeSection(fout, header, SECTION_CONCEPTS, strings.data(), strings.size());
+
+    strings.clear();
+    for(const std::string& dir : db.filenames().directories())
+        strings.append(dir.c_str(), dir.size() + 1);
+    writeSection(fout, header, SECTION_DIRECTORIES, strings.data(), strings.size());
+
+    const std::vector<char>& arena = db.filenames().arena();
+    writeSection(fout, header, SECTION_ARENA, arena.data(), arena.size());
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Photos
+
+    std::vector<BinaryPhotoRecord> records(db.photos().size());
+    std::vector<uint32_t> tags;
+    memset(records.data(), 0, records.size() * sizeof(BinaryPhotoRecord));
+
+    for(std::size_t i = 0; i < records.size(); ++i)
+    {
+        const PhotoData& p = db.photos()[i];
+        BinaryPhotoRecord& r = records[i];
+
+        memcpy(r.md5sum, p.md5sum.bytes, sizeof(r.md5sum));
+        r.dir = p.filename.dir;
+        r.name = p.filename.name;
+        r.size = p.stat.size;
+        r.mtime = p.stat.mtime;
+        r.device = p.stat.device;
+        r.inode = p.stat.inode;
+        r.fingerprint = p.fingerprint;
+        r.perceptual_hash = p.perceptual_hash;
+        r.tags_begin = tags.size();
+        r.num_tags = p.tags().size();
+        r.flags = (p.isDone() ? PHOTO_FLAG_DONE : 0) | (p.has_perceptual_hash ? PHOTO_FLAG_PERCEPTUAL_HASH : 0);
+
+        tags.insert(tags.end(), p.tags().begin(), p.tags().end());
+    }
+
+    writeSection(fout, header, SECTION_PHOTOS, records.data(), records.size() * sizeof(BinaryPhotoRecord));
+    writeSection(fout, header, SECTION_TAGS, tags.data(), tags.size() * sizeof(uint32_t));
+
+    const std::vector<HashSlot>& md5sum_slots = db.md5sumIndexSlots();
+    writeSection(fout, header, SECTION_MD5SUM_INDEX, md5sum_slots.data(), md5sum_slots.size() * sizeof(HashSlot));
+
+    const std::vector<HashSlot>& filename_slots = db.filenameIndexSlots();
+    writeSection(fout, header, SECTION_FILENAME_INDEX, filename_slots.data(), filename_slots.size() * sizeof(HashSlot));
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Known duplicates
+
+    std::vector<BinaryDuplicateRecord> duplicates;
+    strings.clear();
+    for(const auto& d : db.duplicates())
+    {
+        BinaryDuplicateRecord r;
+        memset(&r, 0, sizeof(r));
+        memcpy(r.md5sum, d.second.md5sum.bytes, sizeof(r.md5sum));
+        r.photo = d.second.photo;
+        r.size = d.second.stat.size;
+        r.mtime = d.second.stat.mtime;
+        r.device = d.second.stat.device;
+        r.inode = d.second.stat.inode;
+        duplicates.push_back(r);
+
+        strings.append(d.first.c_str(), d.first.size() + 1);
+    }
+
+    writeSection(fout, header, SECTION_DUPLICATES, duplicates.data(), duplicates.size() * sizeof(BinaryDuplicateRecord));
+    writeSection(fout, header, SECTION_DUPLICATE_NAMES, strings.data(), strings.size());
+
+    fout.seekp(0);
+    fout.write((const char*)&header, sizeof(header));
+
+    fout.close();
+    return !fout.fail();
+}
@@ -0,0 +1,98 @@
+#ifndef PHOTO_MANAGER_BINARY_DATABASE_H_
+#define PHOTO_MANAGER_BINARY_DATABASE_H_
+
+#include <string>
+#include <stdint.h>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// Binary database format, in native byte order. The file starts with a BinaryHeader, which locates the
+// sections below (each 8-byte aligned). All sections are flat arrays that are copied as they are, such
+// that opening a database does not parse or hash anything:
+//
+//     CONCEPTS         Null-terminated concept names by id, empty for unused ids
+//     DIRECTORIES      Null-terminated directories of the filename table, by directory id
+//     ARENA            Basename arena of the filename table (see FilenameTable)
+//     PHOTOS           One BinaryPhotoRecord per photo, by id
+//     TAGS             uint32_t concept ids, the tags of each photo being a sorted range
+//     MD5SUM_INDEX     HashSlots of the md5sum index
+//     FILENAME_INDEX   HashSlots of the filename index
+//     DUPLICATES       One BinaryDuplicateRecord per known duplicate (see KnownDuplicate)
+//     DUPLICATE_NAMES  Null-terminated filenames of the known duplicates, in the same order
+//
+// The saved hash indexes depend on the hash functions: change BINARY_DATABASE_VERSION along with them.
+
+enum BinarySection
+{
+    SECTION_CONCEPTS,
+    SECTION_DIRECTORIES,
+    SECTION_ARENA,
+    SECTION_PHOTOS,
+    SECTION_TAGS,
+    SECTION_MD5SUM_INDEX,
+    SECTION_FILENAME_INDEX,
+    SECTION_DUPLICATES,
+    SECTION_DUPLICATE_NAMES,
+    NUM_SECTIONS
+};
+
+static const char BINARY_DATABASE_MAGIC[8] = { 'P', 'H', 'O', 'T', 'O', 'D', 'B', '\0' };
+
+static const uint32_t BINARY_DATABASE_VERSION = 3;
+
+struct BinaryHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t num_sections;
+
+    struct
+    {
+        uint64_t offset;
+        uint64_t size;      // in bytes
+    } sections[NUM_SECTIONS];
+};
+
+struct BinaryPhotoRecord
+{
+    unsigned char md5sum[MD5_DIGEST_SIZE];
+    uint32_t dir;
+    uint32_t name;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t device;
+    uint64_t inode;
+    uint64_t fingerprint;
+    uint64_t perceptual_hash;
+    uint64_t tags_begin;    // Index into the TAGS section
+    uint32_t num_tags;
+    uint32_t flags;
+};
+
+struct BinaryDuplicateRecord
+{
+    unsigned char md5sum[MD5_DIGEST_SIZE];
+    uint64_t photo;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t device;
+    uint64_t inode;
+};
+
+static const uint32_t PHOTO_FLAG_DONE = 1;
+
+static const uint32_t PHOTO_FLAG_PERCEPTUAL_HASH = 2;   // perceptual_hash is valid
+
+// ----------------------------------------------------------------------------------------------------
+
+bool isBinaryDatabase(const char* data, std::size_t size);
+
+// Loads a binary database from memory. Returns false if it is damaged or from another version.
+bool loadBinaryDatabase(const char* data, std::size_t size, const std::string& filename, PhotoDatabase& db);
+
+// Returns false if the file could not be written
+bool writeBinaryDatabase(const PhotoDatabase& db, const std::string& filename);
+
+#endif
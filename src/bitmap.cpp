@@ -0,0 +1,621 @@
+#include "bitmap.h"
+
+#include <algorithm>
+#include <iterator>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+inline bool testBit(const std::vector<uint64_t>& bits, uint16_t low)
+{
+    return (bits[low >> 6] >> (low & 63)) & 1;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Intersects two sorted arrays. If one is much smaller, its values are looked up in the other one by
+// galloping search, otherwise both are merged.
+void intersectArrays(const std::vector<uint16_t>& a, const std::vector<uint16_t>& b, std::vector<uint16_t>& res)
+{
+    const std::vector<uint16_t>& small = (a.size() <= b.size() ? a : b);
+    const std::vector<uint16_t>& large = (a.size() <= b.size() ? b : a);
+
+    res.clear();
+    res.reserve(small.size());
+
+    if (small.size() * 32 < large.size())
+    {
+        auto lo = large.begin();
+        for(uint16_t v : small)
+        {
+            // Double the step until we overshoot, then binary search the last step
+            std::size_t step = 1;
+            auto hi = lo;
+            while(hi != large.end() && *hi < v)
+            {
+                lo = hi;
+                hi = (std::size_t)(large.end() - hi) > step ? hi + step : large.end();
+                step *= 2;
+            }
+
+            lo = std::lower_bound(lo, hi, v);
+            if (lo == large.end())
+                break;
+
+            if (*lo == v)
+                res.push_back(v);
+        }
+    }
+    else
+    {
+        // Branch-free merge: the outcome of each comparison is unpredictable
+        res.resize(small.size());
+        std::size_t i = 0, j = 0, n = 0;
+        while(i < a.size() && j < b.size())
+        {
+            uint16_t x = a[i];
+            uint16_t y = b[j];
+            res[n] = x;
+            n += (x == y);
+            i += (x <= y);
+            j += (y <= x);
+        }
+        res.resize(n);
+    }
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::add(uint16_t low)
+{
+    if (isBitset())
+    {
+        uint64_t& word = bits[low >> 6];
+        uint64_t mask = (uint64_t)1 << (low & 63);
+        if (!(word & mask))
+        {
+            word |= mask;
+            ++cardinality;
+        }
+        return;
+    }
+
+    // Values are usually added in increasing order
+    if (array.empty() || array.back() < low)
+    {
+        array.push_back(low);
+    }
+    else
+    {
+        auto it = std::lower_bound(array.begin(), array.end(), low);
+        if (*it == low)
+            return;
+        array.insert(it, low);
+    }
+
+    ++cardinality;
+    if (cardinality > MAX_ARRAY_SIZE)
+        toBitset();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::remove(uint16_t low)
+{
+    if (isBitset())
+    {
+        uint64_t& word = bits[low >> 6];
+        uint64_t mask = (uint64_t)1 << (low & 63);
+        if (word & mask)
+        {
+            word &= ~mask;
+            --cardinality;
+        }
+
+        // Well below the limit, such that a group that shrinks and grows around it is not converted each time
+        if (cardinality <= MAX_ARRAY_SIZE / 2)
+            toArray();
+        return;
+    }
+
+    auto it = std::lower_bound(array.begin(), array.end(), low);
+    if (it != array.end() && *it == low)
+    {
+        array.erase(it);
+        --cardinality;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Bitmap::Container::contains(uint16_t low) const
+{
+    if (isBitset())
+        return testBit(bits, low);
+
+    return std::binary_search(array.begin(), array.end(), low);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Bitmap::Container::next(uint16_t low, uint16_t& result) const
+{
+    if (!isBitset())
+    {
+        auto it = std::lower_bound(array.begin(), array.end(), low);
+        if (it == array.end())
+            return false;
+
+        result = *it;
+        return true;
+    }
+
+    unsigned int i = low >> 6;
+    uint64_t word = bits[i] & (~(uint64_t)0 << (low & 63));
+    while(word == 0)
+    {
+        if (++i == BITSET_WORDS)
+            return false;
+        word = bits[i];
+    }
+
+    result = i * 64 + __builtin_ctzll(word);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Bitmap::Container::previous(uint16_t low, uint16_t& result) const
+{
+    if (!isBitset())
+    {
+        auto it = std::upper_bound(array.begin(), array.end(), low);
+        if (it == array.begin())
+            return false;
+
+        result = *(it - 1);
+        return true;
+    }
+
+    unsigned int i = low >> 6;
+    uint64_t word = bits[i] & (~(uint64_t)0 >> (63 - (low & 63)));
+    while(word == 0)
+    {
+        if (i == 0)
+            return false;
+        word = bits[--i];
+    }
+
+    result = i * 64 + 63 - __builtin_clzll(word);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::intersect(const Container& a, const Container& b, Container& res)
+{
+    res.key = a.key;
+    res.array.clear();
+    res.bits.clear();
+
+    if (!a.isBitset() && !b.isBitset())
+    {
+        intersectArrays(a.array, b.array, res.array);
+    }
+    else if (!a.isBitset() || !b.isBitset())
+    {
+        const Container& sparse = (a.isBitset() ? b : a);
+        const Container& dense = (a.isBitset() ? a : b);
+
+        res.array.reserve(sparse.array.size());
+        for(uint16_t v : sparse.array)
+        {
+            if (testBit(dense.bits, v))
+                res.array.push_back(v);
+        }
+    }
+    else
+    {
+        res.bits.resize(BITSET_WORDS);
+        unsigned int n = 0;
+        for(unsigned int i = 0; i < BITSET_WORDS; ++i)
+        {
+            res.bits[i] = a.bits[i] & b.bits[i];
+            n += __builtin_popcountll(res.bits[i]);
+        }
+
+        res.cardinality = n;
+        if (n <= MAX_ARRAY_SIZE)
+            res.toArray();
+        return;
+    }
+
+    res.cardinality = res.array.size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::unite(const Container& a, const Container& b, Container& res)
+{
+    res.key = a.key;
+    res.array.clear();
+    res.bits.clear();
+
+    if (!a.isBitset() && !b.isBitset())
+    {
+        res.array.reserve(a.array.size() + b.array.size());
+        std::set_union(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                       std::back_inserter(res.array));
+
+        res.cardinality = res.array.size();
+        if (res.cardinality > MAX_ARRAY_SIZE)
+            res.toBitset();
+    }
+    else if (!a.isBitset() || !b.isBitset())
+    {
+        const Container& sparse = (a.isBitset() ? b : a);
+        const Container& dense = (a.isBitset() ? a : b);
+
+        res.bits = dense.bits;
+        res.cardinality = dense.cardinality;
+        for(uint16_t v : sparse.array)
+        {
+            uint64_t& word = res.bits[v >> 6];
+            uint64_t mask = (uint64_t)1 << (v & 63);
+            res.cardinality += !(word & mask);
+            word |= mask;
+        }
+    }
+    else
+    {
+        res.bits.resize(BITSET_WORDS);
+        unsigned int n = 0;
+        for(unsigned int i = 0; i < BITSET_WORDS; ++i)
+        {
+            res.bits[i] = a.bits[i] | b.bits[i];
+            n += __builtin_popcountll(res.bits[i]);
+        }
+
+        res.cardinality = n;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::subtract(const Container& a, const Container& b, Container& res)
+{
+    res.key = a.key;
+    res.array.clear();
+    res.bits.clear();
+
+    if (!a.isBitset())
+    {
+        res.array.reserve(a.array.size());
+        for(uint16_t v : a.array)
+        {
+            if (!b.contains(v))
+                res.array.push_back(v);
+        }
+
+        res.cardinality = res.array.size();
+        return;
+    }
+
+    res.bits = a.bits;
+    if (!b.isBitset())
+    {
+        res.cardinality = a.cardinality;
+        for(uint16_t v : b.array)
+        {
+            uint64_t& word = res.bits[v >> 6];
+            uint64_t mask = (uint64_t)1 << (v & 63);
+            res.cardinality -= ((word & mask) != 0);
+            word &= ~mask;
+        }
+    }
+    else
+    {
+        unsigned int n = 0;
+        for(unsigned int i = 0; i < BITSET_WORDS; ++i)
+        {
+            res.bits[i] &= ~b.bits[i];
+            n += __builtin_popcountll(res.bits[i]);
+        }
+
+        res.cardinality = n;
+    }
+
+    if (res.cardinality <= MAX_ARRAY_SIZE)
+        res.toArray();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::toBitset()
+{
+    bits.assign(BITSET_WORDS, 0);
+    for(uint16_t v : array)
+        bits[v >> 6] |= (uint64_t)1 << (v & 63);
+
+    std::vector<uint16_t>().swap(array);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::Container::toArray()
+{
+    array.clear();
+    array.reserve(cardinality);
+    for(unsigned int i = 0; i < BITSET_WORDS; ++i)
+    {
+        for(uint64_t word = bits[i]; word != 0; word &= word - 1)
+            array.push_back(i * 64 + __builtin_ctzll(word));
+    }
+
+    std::vector<uint64_t>().swap(bits);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const Bitmap::Container* Bitmap::findContainer(uint16_t key) const
+{
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](const Container& c, uint16_t k) { return c.key < k; });
+
+    if (it == containers_.end() || it->key != key)
+        return nullptr;
+
+    return &*it;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::add(uint32_t value)
+{
+    uint16_t key = value >> 16;
+
+    if (containers_.empty() || containers_.back().key < key)
+    {
+        containers_.push_back(Container(key));
+        containers_.back().add(value & 0xffff);
+        return;
+    }
+
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](const Container& c, uint16_t k) { return c.key < k; });
+
+    if (it->key != key)
+        it = containers_.insert(it, Container(key));
+
+    it->add(value & 0xffff);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::addRange(uint32_t begin, uint32_t end)
+{
+    for(uint32_t v = begin; v < end; ++v)
+        add(v);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::remove(uint32_t value)
+{
+    uint16_t key = value >> 16;
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](const Container& c, uint16_t k) { return c.key < k; });
+
+    if (it == containers_.end() || it->key != key)
+        return;
+
+    it->remove(value & 0xffff);
+    if (it->cardinality == 0)
+        containers_.erase(it);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Bitmap::contains(uint32_t value) const
+{
+    const Container* c = findContainer(value >> 16);
+    return c && c->contains(value & 0xffff);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Bitmap::next(uint32_t value, uint32_t& result) const
+{
+    uint16_t key = value >> 16;
+    auto it = std::lower_bound(containers_.begin(), containers_.end(), key,
+                               [](const Container& c, uint16_t k) { return c.key < k; });
+
+    // Groups are never empty, so a later one has its first value
+    for(; it != containers_.end(); ++it)
+    {
+        uint16_t low;
+        if (it->next(it->key == key ? value & 0xffff : 0, low))
+        {
+            result = (uint32_t)it->key << 16 | low;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Bitmap::previous(uint32_t value, uint32_t& result) const
+{
+    uint16_t key = value >> 16;
+    auto it = std::upper_bound(containers_.begin(), containers_.end(), key,
+                               [](uint16_t k, const Container& c) { return k < c.key; });
+
+    while(it != containers_.begin())
+    {
+        --it;
+
+        uint16_t low;
+        if (it->previous(it->key == key ? value & 0xffff : 0xffff, low))
+        {
+            result = (uint32_t)it->key << 16 | low;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long Bitmap::cardinality() const
+{
+    unsigned long n = 0;
+    for(const Container& c : containers_)
+        n += c.cardinality;
+
+    return n;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::intersect(const Bitmap& a, const Bitmap& b, Bitmap& res)
+{
+    res.containers_.clear();
+
+    auto it_a = a.containers_.begin();
+    auto it_b = b.containers_.begin();
+
+    Container c;
+    while(it_a != a.containers_.end() && it_b != b.containers_.end())
+    {
+        if (it_a->key < it_b->key)
+        {
+            ++it_a;
+        }
+        else if (it_b->key < it_a->key)
+        {
+            ++it_b;
+        }
+        else
+        {
+            Container::intersect(*it_a++, *it_b++, c);
+            if (c.cardinality > 0)
+                res.containers_.push_back(std::move(c));
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::unite(const Bitmap& a, const Bitmap& b, Bitmap& res)
+{
+    res.containers_.clear();
+    res.containers_.reserve(std::max(a.containers_.size(), b.containers_.size()));
+
+    auto it_a = a.containers_.begin();
+    auto it_b = b.containers_.begin();
+
+    while(it_a != a.containers_.end() || it_b != b.containers_.end())
+    {
+        if (it_b == b.containers_.end() || (it_a != a.containers_.end() && it_a->key < it_b->key))
+        {
+            res.containers_.push_back(*it_a++);
+        }
+        else if (it_a == a.containers_.end() || it_b->key < it_a->key)
+        {
+            res.containers_.push_back(*it_b++);
+        }
+        else
+        {
+            res.containers_.push_back(Container());
+            Container::unite(*it_a++, *it_b++, res.containers_.back());
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::subtract(const Bitmap& a, const Bitmap& b, Bitmap& res)
+{
+    res.containers_.clear();
+
+    auto it_b = b.containers_.begin();
+
+    Container c;
+    for(const Container& ca : a.containers_)
+    {
+        while(it_b != b.containers_.end() && it_b->key < ca.key)
+            ++it_b;
+
+        if (it_b == b.containers_.end() || it_b->key != ca.key)
+        {
+            res.containers_.push_back(ca);
+            continue;
+        }
+
+        Container::subtract(ca, *it_b, c);
+        if (c.cardinality > 0)
+            res.containers_.push_back(std::move(c));
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Bitmap& Bitmap::operator&=(const Bitmap& other)
+{
+    Bitmap res;
+    intersect(*this, other, res);
+    containers_.swap(res.containers_);
+    return *this;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Bitmap& Bitmap::operator|=(const Bitmap& other)
+{
+    Bitmap res;
+    unite(*this, other, res);
+    containers_.swap(res.containers_);
+    return *this;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Bitmap& Bitmap::operator-=(const Bitmap& other)
+{
+    Bitmap res;
+    subtract(*this, other, res);
+    containers_.swap(res.containers_);
+    return *this;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Bitmap::toVector(std::vector<unsigned long>& values) const
+{
+    values.reserve(values.size() + cardinality());
+
+    for(const Container& c : containers_)
+    {
+        unsigned long high = (unsigned long)c.key << 16;
+
+        if (!c.isBitset())
+        {
+            for(uint16_t v : c.array)
+                values.push_back(high | v);
+            continue;
+        }
+
+        for(unsigned int i = 0; i < BITSET_WORDS; ++i)
+        {
+            for(uint64_t word = c.bits[i]; word != 0; word &= word - 1)
+                values.push_back(high | (i * 64 + __builtin_ctzll(word)));
+        }
+    }
+}
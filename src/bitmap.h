@@ -0,0 +1,107 @@
+#ifndef PHOTO_MANAGER_BITMAP_H_
+#define PHOTO_MANAGER_BITMAP_H_
+
+#include <vector>
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Compressed set of 32-bit integers, organized like a Roaring bitmap: values are grouped by their upper
+// 16 bits, and each group stores its lower 16 bits either as a sorted array (sparse groups) or as a
+// 65536-bit bitset (dense groups). Both add() and contains() are cheap, and intersections skip over
+// groups that are missing on either side.
+
+class Bitmap
+{
+
+public:
+
+    void add(uint32_t value);
+
+    // Adds all values in [begin, end)
+    void addRange(uint32_t begin, uint32_t end);
+
+    void remove(uint32_t value);
+
+    bool contains(uint32_t value) const;
+
+    // Sets 'result' to the smallest value that is at least 'value'. Returns false if there is none.
+    bool next(uint32_t value, uint32_t& result) const;
+
+    // Sets 'result' to the largest value that is at most 'value'. Returns false if there is none.
+    bool previous(uint32_t value, uint32_t& result) const;
+
+    bool empty() const { return containers_.empty(); }
+
+    unsigned long cardinality() const;
+
+    // Sets 'res' to the intersection of 'a' and 'b'
+    static void intersect(const Bitmap& a, const Bitmap& b, Bitmap& res);
+
+    // Sets 'res' to the union of 'a' and 'b'
+    static void unite(const Bitmap& a, const Bitmap& b, Bitmap& res);
+
+    // Sets 'res' to the values of 'a' that are not in 'b'
+    static void subtract(const Bitmap& a, const Bitmap& b, Bitmap& res);
+
+    Bitmap& operator&=(const Bitmap& other);
+
+    Bitmap& operator|=(const Bitmap& other);
+
+    Bitmap& operator-=(const Bitmap& other);
+
+    // Appends all values in increasing order
+    void toVector(std::vector<unsigned long>& values) const;
+
+private:
+
+    // Groups with more values than this are stored as bitsets
+    static const unsigned int MAX_ARRAY_SIZE = 4096;
+
+    static const unsigned int BITSET_WORDS = 65536 / 64;
+
+    struct Container
+    {
+        Container(uint16_t k = 0) : key(k), cardinality(0) {}
+
+        uint16_t key;
+
+        unsigned int cardinality;
+
+        // Sorted lower 16 bits, if the container is an array
+        std::vector<uint16_t> array;
+
+        // BITSET_WORDS words, if the container is a bitset
+        std::vector<uint64_t> bits;
+
+        bool isBitset() const { return !bits.empty(); }
+
+        void add(uint16_t low);
+
+        void remove(uint16_t low);
+
+        bool contains(uint16_t low) const;
+
+        bool next(uint16_t low, uint16_t& result) const;
+
+        bool previous(uint16_t low, uint16_t& result) const;
+
+        static void intersect(const Container& a, const Container& b, Container& res);
+
+        static void unite(const Container& a, const Container& b, Container& res);
+
+        static void subtract(const Container& a, const Container& b, Container& res);
+
+        void toBitset();
+
+        void toArray();
+    };
+
+    // Sorted by key
+    std::vector<Container> containers_;
+
+    const Container* findContainer(uint16_t key) const;
+
+};
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef PHOTO_MANAGER_BLOCKING_QUEUE_H_
+#define PHOTO_MANAGER_BLOCKING_QUEUE_H_
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Bounded multi-producer / multi-consumer queue. Once closed, pop() drains the remaining items and then
+// returns false.
+
+template<typename T>
+class BlockingQueue
+{
+
+public:
+
+    BlockingQueue(std::size_t capacity = 1024) : capacity_(capacity), closed_(false) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this]() { return items_.size() < capacity_ || closed_; });
+        items_.push_back(std::move(item));
+        not_empty_.notify_one();
+    }
+
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+
+        if (items_.empty())
+            return false;
+
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Non-blocking variant of pop(): returns false if no item is available right now
+    bool tryPop(T& item)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items_.empty())
+            return false;
+
+        item = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+private:
+
+    std::size_t capacity_;
+
+    bool closed_;
+
+    std::deque<T> items_;
+
+    std::mutex mutex_;
+
+    std::condition_variable not_empty_;
+
+    std::condition_variable not_full_;
+
+};
+
+#endif
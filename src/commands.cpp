@@ -0,0 +1,277 @@
+#include "commands.h"
+
+#include "query.h"
+#include "preview_cache.h"
+#include "thumbnail_atlas.h"
+#include "perceptual_hash.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+// ----------------------------------------------------------------------------------------------------
+
+bool searchCommand(const PhotoSnapshot& db, const std::string& prefix, const std::vector<std::string>& args,
+                   std::ostream& out)
+{
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Parse query from command-line arguments
+
+    bool explain = false;
+    std::string text;
+    for(const std::string& arg : args)
+    {
+        if (arg == "--explain")
+        {
+            explain = true;
+            continue;
+        }
+
+        if (!text.empty())
+            text += ' ';
+        text += arg;
+    }
+
+    if (text.empty())
+    {
+        out << "usage: search [--explain] <QUERY>" << std::endl;
+        return false;
+    }
+
+    Query query;
+    std::string error;
+    if (!query.parse(db, text, error))
+    {
+        out << error << std::endl;
+        return false;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Search photos
+
+    std::vector<Id> photo_ids;
+    query.run(db, photo_ids);
+
+    for(Id id : photo_ids)
+    {
+        out << prefix << db.filename(db.photos()[id]) << '\n';
+    }
+
+    if (explain)
+        query.explain(out);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool tagCommand(PhotoDatabase& db, const std::string& prefix, const std::vector<std::string>& args,
+                std::ostream& out)
+{
+    if (args.size() < 2)
+    {
+        out << "usage: tag <FILE> <CONCEPT>" << std::endl;
+        return false;
+    }
+
+    std::string rel_filename = args[0];
+    if (rel_filename.compare(0, prefix.size(), prefix) == 0)
+        rel_filename = rel_filename.substr(prefix.size());
+
+    // Concepts are lower case, and may consist of several words
+    std::string concept;
+    for(std::size_t i = 1; i < args.size(); ++i)
+    {
+        if (!concept.empty())
+            concept += ' ';
+        concept += args[i];
+    }
+    std::transform(concept.begin(), concept.end(), concept.begin(), ::tolower);
+
+    const PhotoData* p = db.findPhotoByFilename(rel_filename);
+    if (!p)
+    {
+        out << "Unknown photo: " << rel_filename << std::endl;
+        return false;
+    }
+
+    Id tag_id;
+    if (!db.getConceptId(concept, tag_id))
+        tag_id = db.addConcept(concept);
+
+    db.addPhotoTag(db.photo(p->id()), tag_id);
+
+    out << "Tagged '" << rel_filename << "' with '" << concept << "'" << std::endl;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool statCommand(const PhotoSnapshot& db, std::ostream& out)
+{
+    unsigned long n_concepts = 0;
+    for(const std::string& concept : db.concepts())
+        n_concepts += !concept.empty();
+
+    unsigned long n_tagged = 0, n_done = 0, n_tags = 0;
+    for(const PhotoData& p : db.photos())
+    {
+        n_tagged += !p.tags().empty();
+        n_done += p.isDone();
+        n_tags += p.tags().size();
+    }
+
+    out << "Photos:      " << db.photos().size() << '\n';
+    out << "Tagged:      " << n_tagged << '\n';
+    out << "Done:        " << n_done << '\n';
+    out << "Tags:        " << n_tags << '\n';
+    out << "Concepts:    " << n_concepts << '\n';
+    out << "Directories: " << db.filenames().numDirectories() << '\n';
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool previewsCommand(const PhotoDatabase& db, const std::string& database_filename,
+                     const std::vector<std::string>& args, std::ostream& out)
+{
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned long max_mb = 1024;
+    for(unsigned int i = 0; i + 1 < args.size(); ++i)
+    {
+        if (args[i] == "--jobs")
+            num_threads = atoi(args[++i].c_str());
+        else if (args[i] == "--max-size")
+            max_mb = atol(args[++i].c_str());
+    }
+
+    makePreviews(db, database_filename, num_threads, out);
+
+    PreviewCache previews(previewDirectory(database_filename));
+    previews.trim(db, max_mb << 20);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void makePreviews(const PhotoDatabase& db, const std::string& database_filename, unsigned int num_threads,
+                  std::ostream& out)
+{
+    auto t_start = std::chrono::steady_clock::now();
+
+    PreviewCache previews(previewDirectory(database_filename));
+    unsigned long n = previews.generate(db, num_threads);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    out << "Made " << n << " previews in " << secs << " s" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void makeThumbnails(const PhotoDatabase& db, const std::string& database_filename, unsigned int num_threads,
+                    std::ostream& out)
+{
+    auto t_start = std::chrono::steady_clock::now();
+
+    long n = buildThumbnails(db, thumbnailFilename(database_filename), num_threads);
+    if (n < 0)
+        return;
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    out << "Made " << n << " thumbnails in " << secs << " s" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void makePerceptualHashes(PhotoDatabase& db, unsigned int num_threads, std::ostream& out)
+{
+    auto t_start = std::chrono::steady_clock::now();
+
+    unsigned long n = hashPhotos(db, num_threads);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+    out << "Hashed " << n << " photos in " << secs << " s" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool dupesCommand(PhotoDatabase& db, const std::string& prefix, const std::vector<std::string>& args,
+                  std::ostream& out)
+{
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    unsigned int max_distance = 4;
+    for(unsigned int i = 0; i + 1 < args.size(); ++i)
+    {
+        if (args[i] == "--jobs")
+            num_threads = atoi(args[++i].c_str());
+        else if (args[i] == "--distance")
+            max_distance = atoi(args[++i].c_str());
+    }
+
+    if (max_distance > 16)
+    {
+        out << "The distance must be at most 16 of the 64 bits of the hashes" << std::endl;
+        return false;
+    }
+
+    makePerceptualHashes(db, num_threads, out);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Group the photos with hashes
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    std::vector<std::pair<unsigned long, Id> > photos;
+    for(const PhotoData& p : db.photos())
+    {
+        if (p.has_perceptual_hash)
+            photos.push_back(std::make_pair(p.perceptual_hash, p.id()));
+    }
+
+    std::vector<std::vector<Id> > groups;
+    findNearDuplicates(photos, max_distance, num_threads, groups);
+
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    unsigned long n_photos = 0;
+    for(const std::vector<Id>& group : groups)
+    {
+        for(Id id : group)
+            out << prefix << db.filename(db.photos()[id]) << '\n';
+        out << '\n';
+
+        n_photos += group.size();
+    }
+
+    out << groups.size() << " groups of near-duplicates with " << n_photos << " photos, found in " << secs
+        << " s" << std::endl;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void parseScanOptions(const std::vector<std::string>& args, ScanOptions& opts)
+{
+    for(unsigned int i = 0; i < args.size(); ++i)
+    {
+        if (args[i] == "--jobs" && i + 1 < args.size())
+            opts.num_jobs = atoi(args[++i].c_str());
+        else if (args[i] == "--direct")
+            opts.direct_io = true;
+        else if (args[i] == "--io" && i + 1 < args.size())
+            opts.io_backend = (args[++i] == "uring" ? SCAN_IO_URING : SCAN_IO_THREADS);
+        else if (args[i] == "--queue-depth" && i + 1 < args.size())
+            opts.queue_depth = atoi(args[++i].c_str());
+        else if (args[i] == "--order" && i + 1 < args.size())
+        {
+            std::string order = args[++i];
+            if (order == "inode")
+                opts.read_order = SCAN_ORDER_INODE;
+            else if (order == "extent")
+                opts.read_order = SCAN_ORDER_EXTENT;
+            else
+                opts.read_order = SCAN_ORDER_NONE;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef PHOTO_MANAGER_COMMANDS_H_
+#define PHOTO_MANAGER_COMMANDS_H_
+
+#include <string>
+#include <vector>
+#include <ostream>
+
+#include "photo_database.h"
+#include "scanner.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// Commands that run either on a database loaded by main() or in the server (see server.h). Filenames in
+// the output are prefixed with 'prefix', the image directory of the caller. Return false on errors.
+
+// search [--explain] <QUERY>
+bool searchCommand(const PhotoSnapshot& db, const std::string& prefix, const std::vector<std::string>& args,
+                   std::ostream& out);
+
+// tag <FILE> <CONCEPT>: FILE is either relative to the image directory or starts with 'prefix'
+bool tagCommand(PhotoDatabase& db, const std::string& prefix, const std::vector<std::string>& args,
+                std::ostream& out);
+
+// stat: number of photos, concepts and so on
+bool statCommand(const PhotoSnapshot& db, std::ostream& out);
+
+// previews [--jobs N] [--max-size MB]: makes the missing previews of all photos (see preview_cache.h), then
+// deletes those of photos that are gone and the least recently used ones beyond MB
+bool previewsCommand(const PhotoDatabase& db, const std::string& database_filename,
+                     const std::vector<std::string>& args, std::ostream& out);
+
+// Makes the missing previews, e.g., after a scan with --previews
+void makePreviews(const PhotoDatabase& db, const std::string& database_filename, unsigned int num_threads,
+                  std::ostream& out);
+
+// Makes the missing thumbnails of the GUI's grid (see thumbnail_atlas.h), e.g., after a scan with --thumbnails
+void makeThumbnails(const PhotoDatabase& db, const std::string& database_filename, unsigned int num_threads,
+                    std::ostream& out);
+
+// Hashes the photos that have no perceptual hash yet (see perceptual_hash.h), e.g., after a scan with --hashes
+void makePerceptualHashes(PhotoDatabase& db, unsigned int num_threads, std::ostream& out);
+
+// dupes [--distance D] [--jobs N]: hashes the photos that have no perceptual hash yet, then prints groups of
+// photos whose hashes differ in at most D bits (default: 4), e.g., resized or re-encoded copies
+bool dupesCommand(PhotoDatabase& db, const std::string& prefix, const std::vector<std::string>& args,
+                  std::ostream& out);
+
+// Options of the scan and watch commands
+void parseScanOptions(const std::vector<std::string>& args, ScanOptions& opts);
+
+#endif
@@ -0,0 +1,134 @@
+#include "concept_index.h"
+
+#include <algorithm>
+#include <queue>
+
+const unsigned int ConceptIndex::NONE;
+
+// ----------------------------------------------------------------------------------------------------
+
+void ConceptIndex::build(const std::vector<std::string>& names, const std::vector<unsigned long>& usage)
+{
+    sorted_.clear();
+    for(unsigned long id = 0; id < names.size(); ++id)
+    {
+        if (!names[id].empty())
+            sorted_.push_back(id);
+    }
+
+    std::sort(sorted_.begin(), sorted_.end(),
+              [&names](unsigned long a, unsigned long b) { return names[a] < names[b]; });
+
+    usage_ = usage;
+    usage_.resize(names.size(), 0);
+
+    buildTree();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ConceptIndex::add(const std::vector<std::string>& names, unsigned long id)
+{
+    auto it = std::lower_bound(sorted_.begin(), sorted_.end(), id,
+                               [&names](unsigned long a, unsigned long b) { return names[a] < names[b]; });
+    sorted_.insert(it, id);
+
+    if (id >= usage_.size())
+        usage_.resize(id + 1, 0);
+    usage_[id] = 0;
+
+    buildTree();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ConceptIndex::addUsage(unsigned long id)
+{
+    if (id >= pos_.size() || pos_[id] == NONE)
+        return;
+
+    ++usage_[id];
+
+    std::size_t n = sorted_.size();
+    for(std::size_t i = (pos_[id] + n) / 2; i > 0; i /= 2)
+        tree_[i] = better(tree_[2 * i], tree_[2 * i + 1]);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ConceptIndex::complete(const std::vector<std::string>& names, const std::string& prefix, std::size_t k,
+                            std::vector<unsigned long>& completions) const
+{
+    completions.clear();
+
+    // The names that start with the prefix follow the first one that is not less than it
+    auto begin = std::lower_bound(sorted_.begin(), sorted_.end(), prefix,
+                                  [&names](unsigned long id, const std::string& s) { return names[id] < s; });
+    auto end = std::partition_point(begin, sorted_.end(), [&names, &prefix](unsigned long id)
+    {
+        return names[id].compare(0, prefix.size(), prefix) == 0;
+    });
+
+    if (begin == end || k == 0)
+        return;
+
+    // Ranges by their best concept, the best range on top. Taking one splits its range in two.
+    struct Range
+    {
+        unsigned int best, begin, end;
+    };
+
+    auto worse = [this](const Range& a, const Range& b) { return better(a.best, b.best) == b.best; };
+    std::priority_queue<Range, std::vector<Range>, decltype(worse)> ranges(worse);
+
+    unsigned int b = begin - sorted_.begin();
+    unsigned int e = end - sorted_.begin();
+    ranges.push(Range{ best(b, e), b, e });
+
+    while(!ranges.empty() && completions.size() < k)
+    {
+        Range r = ranges.top();
+        ranges.pop();
+        completions.push_back(sorted_[r.best]);
+
+        if (r.begin < r.best)
+            ranges.push(Range{ best(r.begin, r.best), r.begin, r.best });
+        if (r.best + 1 < r.end)
+            ranges.push(Range{ best(r.best + 1, r.end), r.best + 1, r.end });
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned int ConceptIndex::best(unsigned int begin, unsigned int end) const
+{
+    std::size_t n = sorted_.size();
+
+    unsigned int result = NONE;
+    for(std::size_t l = begin + n, r = end + n; l < r; l /= 2, r /= 2)
+    {
+        if (l & 1)
+            result = better(result, tree_[l++]);
+        if (r & 1)
+            result = better(result, tree_[--r]);
+    }
+
+    return result;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ConceptIndex::buildTree()
+{
+    std::size_t n = sorted_.size();
+
+    pos_.assign(usage_.size(), NONE);
+    for(std::size_t i = 0; i < n; ++i)
+        pos_[sorted_[i]] = i;
+
+    tree_.resize(2 * n);
+    for(std::size_t i = 0; i < n; ++i)
+        tree_[n + i] = i;
+    for(std::size_t i = n - 1; n > 0 && i > 0; --i)
+        tree_[i] = better(tree_[2 * i], tree_[2 * i + 1]);
+}
@@ -0,0 +1,68 @@
+#ifndef PHOTO_MANAGER_CONCEPT_INDEX_H_
+#define PHOTO_MANAGER_CONCEPT_INDEX_H_
+
+#include <vector>
+#include <string>
+#include <cstddef>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Concept ids sorted by name, such that the concepts with a prefix are a range, with a max segment tree
+// over their usage (the number of photos tagged with them) to take the most used ones out of a range in
+// O(k log n). Names are not stored; they are passed to each call, as kept by the database. Empty names
+// (unused ids) are left out.
+
+class ConceptIndex
+{
+
+public:
+
+    void build(const std::vector<std::string>& names, const std::vector<unsigned long>& usage);
+
+    // A concept that was not in the index yet, with no usage. Takes O(n).
+    void add(const std::vector<std::string>& names, unsigned long id);
+
+    // One more photo is tagged with a concept
+    void addUsage(unsigned long id);
+
+    // Up to 'k' concepts that start with 'prefix', the most used first, and those used as often in order
+    // of their names
+    void complete(const std::vector<std::string>& names, const std::string& prefix, std::size_t k,
+                  std::vector<unsigned long>& completions) const;
+
+private:
+
+    static const unsigned int NONE = (unsigned int)-1;
+
+    // Concept ids by name
+    std::vector<unsigned long> sorted_;
+
+    // Position in sorted_ by id, NONE for unused ids
+    std::vector<unsigned int> pos_;
+
+    std::vector<unsigned long> usage_;
+
+    // Position of the most used concept per node; the leaves, at sorted_.size() + i, are positions i
+    std::vector<unsigned int> tree_;
+
+    // The position of the more used concept, or of the first one if they are used as often
+    unsigned int better(unsigned int a, unsigned int b) const
+    {
+        if (a == NONE)
+            return b;
+        if (b == NONE)
+            return a;
+
+        unsigned long usage_a = usage_[sorted_[a]];
+        unsigned long usage_b = usage_[sorted_[b]];
+        return (usage_a > usage_b || (usage_a == usage_b && a < b)) ? a : b;
+    }
+
+    // Position of the most used concept in [begin, end)
+    unsigned int best(unsigned int begin, unsigned int end) const;
+
+    void buildTree();
+
+};
+
+#endif
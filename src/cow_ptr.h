@@ -0,0 +1,41 @@
+#ifndef PHOTO_MANAGER_COW_PTR_H_
+#define PHOTO_MANAGER_COW_PTR_H_
+
+#include <memory>
+#include <atomic>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Shared, copy-on-write value. Copies of a CowPtr share the value until one of them is written through
+// write(), which first gives that copy a value of its own. Copies may be read on other threads while the
+// original is written, as long as each CowPtr object itself is only used by one thread.
+
+template<typename T>
+class CowPtr
+{
+
+public:
+
+    CowPtr() : p_(std::make_shared<T>()) {}
+
+    const T& operator*() const { return *p_; }
+
+    const T* operator->() const { return p_.get(); }
+
+    T& write()
+    {
+        if (p_.use_count() > 1)
+            p_ = std::make_shared<T>(*p_);
+
+        // If other copies were just released, their last reads have to happen before the writes that follow
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return *p_;
+    }
+
+private:
+
+    std::shared_ptr<T> p_;
+
+};
+
+#endif
@@ -0,0 +1,266 @@
+#include "dir_walker.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+struct linux_dirent64
+{
+    unsigned long d_ino;
+    long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static const unsigned int DIRENT_BUFFER_SIZE = 64 * 1024;
+
+// ----------------------------------------------------------------------------------------------------
+
+void toFileStat(const struct stat& st, FileStat& fstat)
+{
+    fstat.size = st.st_size;
+    fstat.mtime = (unsigned long)st.st_mtim.tv_sec * 1000000000ul + st.st_mtim.tv_nsec;
+    fstat.device = st.st_dev;
+    fstat.inode = st.st_ino;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned char toDirentType(mode_t mode)
+{
+    if (S_ISDIR(mode))
+        return DT_DIR;
+    if (S_ISREG(mode))
+        return DT_REG;
+    if (S_ISLNK(mode))
+        return DT_LNK;
+    return DT_UNKNOWN;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Walks directories depth-first. Subdirectories are handed to other threads only when some thread is
+// waiting for work; otherwise they are walked directly, relative to their parent's file descriptor.
+
+class Walker
+{
+
+public:
+
+    Walker(int root_fd) : root_fd_(root_fd), n_active_(0), n_waiting_(0)
+    {
+        pending_.push_back("");
+    }
+
+    void run(std::vector<PhotoFile>& files)
+    {
+        std::vector<char> buffer(DIRENT_BUFFER_SIZE);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true)
+        {
+            if (!pending_.empty())
+            {
+                std::string path = std::move(pending_.back());
+                pending_.pop_back();
+                ++n_active_;
+                lock.unlock();
+
+                int fd = openat(root_fd_, path.empty() ? "." : path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd >= 0)
+                    walk(fd, path, files, &buffer[0]);
+
+                lock.lock();
+                --n_active_;
+                continue;
+            }
+
+            if (n_active_ == 0)
+            {
+                // Nothing pending and nobody that can produce more work
+                cv_.notify_all();
+                return;
+            }
+
+            ++n_waiting_;
+            cv_.wait(lock);
+            --n_waiting_;
+        }
+    }
+
+private:
+
+    int root_fd_;
+
+    std::mutex mutex_;
+
+    std::condition_variable cv_;
+
+    std::vector<std::string> pending_;
+
+    unsigned int n_active_;
+
+    std::atomic<unsigned int> n_waiting_;
+
+    // 'path' is the directory's path relative to the root, ending with a '/' (or empty for the root). It is
+    // used as a scratch buffer and restored on return. Takes ownership of 'dir_fd'.
+    void walk(int dir_fd, std::string& path, std::vector<PhotoFile>& files, char* buffer)
+    {
+        std::vector<std::string> subdirs;
+
+        while(true)
+        {
+            long n = syscall(SYS_getdents64, dir_fd, buffer, DIRENT_BUFFER_SIZE);
+            if (n <= 0)
+                break;
+
+            for(long offset = 0; offset < n; )
+            {
+                linux_dirent64* entry = (linux_dirent64*)(buffer + offset);
+                offset += entry->d_reclen;
+
+                const char* name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                    continue;
+
+                unsigned char type = entry->d_type;
+
+                struct stat st;
+                if (type == DT_UNKNOWN)
+                {
+                    // Not all file systems fill in d_type
+                    if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+                        continue;
+                    type = toDirentType(st.st_mode);
+                }
+
+                if (type == DT_DIR)
+                {
+                    subdirs.push_back(name);
+                }
+                else if ((type == DT_REG || type == DT_LNK) && isPhotoFilename(name))
+                {
+                    if (fstatat(dir_fd, name, &st, 0) == 0 && S_ISREG(st.st_mode))
+                    {
+                        files.push_back(PhotoFile());
+                        PhotoFile& f = files.back();
+                        f.rel_filename.reserve(path.size() + strlen(name));
+                        f.rel_filename = path;
+                        f.rel_filename += name;
+                        toFileStat(st, f.stat);
+                    }
+                }
+            }
+        }
+
+        std::size_t path_size = path.size();
+        for(const std::string& subdir : subdirs)
+        {
+            path += subdir;
+            path += '/';
+
+            if (n_waiting_ > 0)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                pending_.push_back(path);
+                cv_.notify_one();
+            }
+            else
+            {
+                int fd = openat(dir_fd, subdir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (fd >= 0)
+                    walk(fd, path, files, buffer);
+            }
+
+            path.resize(path_size);
+        }
+
+        close(dir_fd);
+    }
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+bool comparePhotoFiles(const PhotoFile& a, const PhotoFile& b)
+{
+    return a.rel_filename < b.rel_filename;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+bool statFile(const std::string& filename, FileStat& fstat)
+{
+    struct stat st;
+    if (::stat(filename.c_str(), &st) < 0 || !S_ISREG(st.st_mode))
+        return false;
+
+    toFileStat(st, fstat);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool isPhotoFilename(const char* name)
+{
+    if (name[0] == '.')
+        return false;
+
+    const char* ext = strrchr(name, '.');
+    if (!ext)
+        return false;
+
+    return strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0 || strcasecmp(ext, ".png") == 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool findPhotoFiles(const std::string& root, unsigned int num_threads, std::vector<PhotoFile>& files)
+{
+    int root_fd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd < 0)
+        return false;
+
+    num_threads = std::max(1u, num_threads);
+
+    Walker walker(root_fd);
+
+    std::vector<std::vector<PhotoFile> > thread_files(num_threads);
+    std::vector<std::thread> threads;
+    for(unsigned int i = 1; i < num_threads; ++i)
+        threads.push_back(std::thread(&Walker::run, &walker, std::ref(thread_files[i])));
+
+    walker.run(thread_files[0]);
+
+    for(std::thread& t : threads)
+        t.join();
+
+    close(root_fd);
+
+    for(std::vector<PhotoFile>& tf : thread_files)
+    {
+        files.insert(files.end(), std::make_move_iterator(tf.begin()), std::make_move_iterator(tf.end()));
+        std::vector<PhotoFile>().swap(tf);
+    }
+
+    std::sort(files.begin(), files.end(), comparePhotoFiles);
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef PHOTO_MANAGER_DIR_WALKER_H_
+#define PHOTO_MANAGER_DIR_WALKER_H_
+
+#include <string>
+#include <vector>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+struct PhotoFile
+{
+    std::string rel_filename;
+    FileStat stat;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Fills in size, mtime, device and inode. Returns false if the file does not exist or is not a regular file.
+bool statFile(const std::string& filename, FileStat& stat);
+
+// Returns true if the filename is not hidden and has a photo extension (.jpg, .jpeg or .png, any case)
+bool isPhotoFilename(const char* name);
+
+// Recursively finds all photo files below 'root' using 'num_threads' threads. Entries are read with
+// getdents64 and classified by their d_type, such that only photo files (and entries of unknown type)
+// are stat'ed, relative to their directory's file descriptor. Symbolic links to files are followed,
+// symbolic links to directories are not. The result is sorted by filename. Returns false if 'root' cannot
+// be opened; subdirectories that cannot be opened are skipped.
+bool findPhotoFiles(const std::string& root, unsigned int num_threads, std::vector<PhotoFile>& files);
+
+#endif
@@ -0,0 +1,118 @@
+#include "filename_table.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+FilenameTable::FilenameTable()
+{
+    // Directory 0 is the root, and a default handle is the empty filename
+    dirs_.push_back("");
+    dir_index_.insert(0, DirectoryOf(dirs_));
+    arena_.push_back('\0');
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FilenameHandle FilenameTable::add(const char* rel_filename, std::size_t size)
+{
+    std::size_t dir_size = 0;
+    for(std::size_t i = size; i > 0; --i)
+    {
+        if (rel_filename[i - 1] == '/')
+        {
+            dir_size = i;
+            break;
+        }
+    }
+
+    FilenameHandle h;
+
+    unsigned long dir;
+    if (dir_index_.find(StringRef(rel_filename, dir_size), DirectoryOf(dirs_), dir))
+    {
+        h.dir = dir;
+    }
+    else
+    {
+        h.dir = dirs_.size();
+        dirs_.push_back(std::string(rel_filename, dir_size));
+        dir_index_.insert(h.dir, DirectoryOf(dirs_));
+    }
+
+    h.name = arena_.size();
+    arena_.insert(arena_.end(), rel_filename + dir_size, rel_filename + size);
+    arena_.push_back('\0');
+
+    return h;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FilenameTable::assign(const std::vector<std::string>& dirs, const char* arena, std::size_t arena_size)
+{
+    *this = FilenameTable();
+
+    // The root directory and the empty basename are where the constructor puts them
+    if (dirs.empty() || !dirs[0].empty() || arena_size == 0 || arena[0] != '\0' || arena[arena_size - 1] != '\0')
+        return false;
+
+    for(std::size_t i = 1; i < dirs.size(); ++i)
+    {
+        dirs_.push_back(dirs[i]);
+        dir_index_.insert(i, DirectoryOf(dirs_));
+    }
+
+    arena_.assign(arena, arena + arena_size);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+uint32_t FilenameTable::append(const FilenameTable& other, std::vector<uint32_t>& dir_map)
+{
+    dir_map.resize(other.dirs_.size());
+    for(std::size_t i = 0; i < other.dirs_.size(); ++i)
+    {
+        const std::string& dir = other.dirs_[i];
+
+        unsigned long id;
+        if (!dir_index_.find(StringRef(dir.data(), dir.size()), DirectoryOf(dirs_), id))
+        {
+            id = dirs_.size();
+            dirs_.push_back(dir);
+            dir_index_.insert(id, DirectoryOf(dirs_));
+        }
+
+        dir_map[i] = id;
+    }
+
+    uint32_t offset = arena_.size();
+    arena_.insert(arena_.end(), other.arena_.begin(), other.arena_.end());
+
+    return offset;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FilenameTable::lookup(const std::string& rel_filename, FilenameKey& key) const
+{
+    std::size_t dir_size = rel_filename.rfind('/') + 1;
+
+    unsigned long dir;
+    if (!dir_index_.find(StringRef(rel_filename.data(), dir_size), DirectoryOf(dirs_), dir))
+        return false;
+
+    key.dir = dir;
+    key.name = StringRef(rel_filename.data() + dir_size, rel_filename.size() - dir_size);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::size_t FilenameTable::memoryUsage() const
+{
+    std::size_t n = arena_.capacity() + dir_index_.memoryUsage() + dirs_.capacity() * sizeof(std::string);
+    for(const std::string& dir : dirs_)
+        n += dir.capacity();
+
+    return n;
+}
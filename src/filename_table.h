@@ -0,0 +1,129 @@
+#ifndef PHOTO_MANAGER_FILENAME_TABLE_H_
+#define PHOTO_MANAGER_FILENAME_TABLE_H_
+
+#include <string>
+#include <vector>
+#include <string.h>
+#include <stdint.h>
+
+#include "hash_index.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// Relative filename as stored in the database: a directory, shared by all files in it, and the offset of
+// the basename in the string arena of the FilenameTable.
+
+struct FilenameHandle
+{
+    FilenameHandle() : dir(0), name(0) {}
+
+    uint32_t dir;
+    uint32_t name;
+};
+
+// Borrowed reference to a (possibly not null-terminated) string
+struct StringRef
+{
+    StringRef(const char* d = "", std::size_t n = 0) : data(d), size(n) {}
+
+    const char* data;
+    std::size_t size;
+
+    bool operator==(const StringRef& other) const
+    {
+        return size == other.size && memcmp(data, other.data, size) == 0;
+    }
+};
+
+struct StringRefHash
+{
+    std::size_t operator()(const StringRef& s) const { return hashBytes(s.data, s.size); }
+};
+
+// Key to look up a filename without building its string
+struct FilenameKey
+{
+    uint32_t dir;
+    StringRef name;
+
+    bool operator==(const FilenameKey& other) const { return dir == other.dir && name == other.name; }
+};
+
+struct FilenameKeyHash
+{
+    std::size_t operator()(const FilenameKey& key) const
+    {
+        return hashBytes(key.name.data, key.name.size) ^ ((uint64_t)key.dir * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Stores filenames split into a table of directories (with a trailing '/', the root being empty) and
+// a contiguous arena of null-terminated basenames. Basenames that are no longer referenced (after a
+// rename) stay in the arena until the database is reloaded.
+
+class FilenameTable
+{
+
+public:
+
+    FilenameTable();
+
+    FilenameHandle add(const char* rel_filename, std::size_t size);
+
+    FilenameHandle add(const std::string& rel_filename) { return add(rel_filename.data(), rel_filename.size()); }
+
+    // Appends all filenames of 'other'. A handle h of 'other' becomes (dir_map[h.dir], returned offset + h.name).
+    uint32_t append(const FilenameTable& other, std::vector<uint32_t>& dir_map);
+
+    // Returns false if the file's directory does not occur in the table, i.e., the file cannot be either
+    bool lookup(const std::string& rel_filename, FilenameKey& key) const;
+
+    FilenameKey key(FilenameHandle h) const
+    {
+        FilenameKey k;
+        k.dir = h.dir;
+        k.name = StringRef(basename(h), strlen(basename(h)));
+        return k;
+    }
+
+    const std::string& directory(FilenameHandle h) const { return dirs_[h.dir]; }
+
+    const char* basename(FilenameHandle h) const { return &arena_[h.name]; }
+
+    std::string filename(FilenameHandle h) const { return directory(h) + basename(h); }
+
+    std::size_t numDirectories() const { return dirs_.size(); }
+
+    // True if only what the constructor puts in is there
+    bool empty() const { return dirs_.size() == 1 && arena_.size() == 1; }
+
+    // Raw contents, such that a table can be saved and restored with the same handles
+    const std::vector<std::string>& directories() const { return dirs_; }
+
+    const std::vector<char>& arena() const { return arena_; }
+
+    // Restores saved contents. Returns false (leaving the table empty) if they cannot be valid.
+    bool assign(const std::vector<std::string>& dirs, const char* arena, std::size_t arena_size);
+
+    std::size_t memoryUsage() const;
+
+private:
+
+    std::vector<std::string> dirs_;
+
+    struct DirectoryOf
+    {
+        DirectoryOf(const std::vector<std::string>& d) : dirs(d) {}
+        StringRef operator()(unsigned long id) const { return StringRef(dirs[id].data(), dirs[id].size()); }
+        const std::vector<std::string>& dirs;
+    };
+
+    HashIndex<StringRef, StringRefHash> dir_index_;
+
+    std::vector<char> arena_;
+
+};
+
+#endif
@@ -1,16 +1,95 @@
 #include "gui.h"
 
 #include "photo_database.h"
+#include "query.h"
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
 #include <iostream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <sstream>
 
 // ----------------------------------------------------------------------------------------------------
 
-GUI::GUI(PhotoDatabase* db, unsigned int photo_idx) : db_(db), photo_idx_(photo_idx)/*, cache_current_idx_(0), cache_break_idx_(0)*/
+namespace
 {
+
+// Decoded photos of up to 800x600 take up to 1.4 MB each
+static const std::size_t CACHE_SIZE = 256 << 20;
+
+// Photos decoded ahead in the direction the user moves, and behind
+static const unsigned int PREFETCH_AHEAD = 8;
+
+static const unsigned int PREFETCH_BEHIND = 2;
+
+static const int DECODE_POLL_MS = 5;
+
+// Thumbnails per page of the grid, and the space around each
+static const unsigned int GRID_COLS = 10;
+
+static const unsigned int GRID_ROWS = 10;
+
+static const int GRID_SPACING = 8;
+
+// Height of the typed text and completions above the grid
+static const int GRID_HEADER = 50 + 20 * 3;
+
+// Concepts offered for what is typed, the first of which Enter applies
+static const std::size_t NUM_COMPLETIONS = 5;
+
+typedef std::chrono::steady_clock Clock;
+
+// The photo, or a message if it could not be read
+cv::Mat displayable(const cv::Mat& photo, const std::string& filename)
+{
+    if (photo.data)
+        return photo;
+
+    cv::Mat msg(PREVIEW_HEIGHT, PREVIEW_WIDTH, CV_8UC3, cv::Scalar(0, 0, 0));
+    cv::putText(msg, "Cannot read '" + filename + "'", cv::Point(20, 20), cv::FONT_HERSHEY_COMPLEX_SMALL, 0.6,
+                cv::Scalar(0, 0, 255), 1);
+    return msg;
+}
+
+void drawTyped(cv::Mat& canvas, const std::string& typed, const std::vector<std::string>& completions)
+{
+    cv::putText(canvas, typed, cv::Point(10, 20),  cv::FONT_HERSHEY_COMPLEX_SMALL, 1, cv::Scalar(0, 0, 255), 1);
+
+    int y = 40;
+    for(std::size_t i = 0; i < completions.size(); ++i)
+    {
+        cv::putText(canvas, completions[i], cv::Point(10, y),  cv::FONT_HERSHEY_COMPLEX_SMALL, i == 0 ? 1 : 0.7,
+                    i == 0 ? cv::Scalar(255, 0, 0) : cv::Scalar(160, 160, 160), 1);
+        y += 20;
+    }
+}
+
+void printTimes(const std::string& what, std::vector<double> times_ms)
+{
+    if (times_ms.empty())
+        return;
+
+    std::sort(times_ms.begin(), times_ms.end());
+    std::cout << what << " (" << times_ms.size() << " times): median " << times_ms[times_ms.size() / 2]
+              << " ms, 90% " << times_ms[times_ms.size() * 9 / 10] << " ms, max " << times_ms.back() << " ms"
+              << std::endl;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+GUI::GUI(PhotoDatabase* db, const std::string& database_filename, unsigned int photo_idx) : db_(db),
+    photo_idx_(photo_idx), direction_(1), previews_(previewDirectory(database_filename)),
+    cache_([this](const PhotoSource& s) { return previews_.load(s.md5sum, s.filename); }, CACHE_SIZE,
+           std::max(1u, std::min(4u, std::thread::hardware_concurrency()))),
+    filtered_(false), remaining_(0)
+{
+    // Without one the grid shows empty cells, see buildThumbnails()
+    thumbnails_.open(thumbnailFilename(database_filename));
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -28,6 +107,12 @@ void GUI::run()
 
     std::string typed;
     std::string concept;
+    std::vector<std::string> completions;
+
+    // E.g., why a filter was not set
+    std::string message;
+
+    countRemaining();
 
     cv::Mat photo;
     cv::Mat canvas;
@@ -35,25 +120,38 @@ void GUI::run()
     bool reload = true;
     bool redraw = true;
 
+    // The embedded preview is shown while the photo is decoded
+    bool decoding = false;
+
+    // Time from a navigation key to the first frame of the next photo
+    std::vector<double> first_frame_ms;
+    Clock::time_point t_key;
+    bool navigated = false;
+
     while(true)
     {
         if (reload)
         {
-            const PhotoData& pdata = db_->photos()[photo_idx_];
-            cv::Mat img = cv::imread(db_->photoPrefixPath() + pdata.rel_filename);
-
-            if (img.data)
-            {
-                double f = std::min(800.0 / img.cols, 600.0 / img.rows);
-                cv::resize(img, photo, cv::Size(), f, f);
-            }
-            else
+            PhotoSource src = source(photo_idx_);
+            decoding = !cache_.tryGet(photo_idx_, photo);
+            if (decoding)
             {
-                photo = cv::Mat(600, 800, CV_8UC3, cv::Scalar(0, 0, 0));
-                cv::putText(photo, "Cannot read '" + pdata.rel_filename + "'", cv::Point(20, 20),
-                            cv::FONT_HERSHEY_COMPLEX_SMALL, 0.6, cv::Scalar(0, 0, 255), 1);
+                photo = decodeEmbeddedPreview(src.filename);
+
+                // Without one there is nothing to show until the photo itself is decoded
+                if (!photo.data)
+                {
+                    photo = cache_.get(src);
+                    decoding = false;
+                }
             }
 
+            if (!decoding)
+                photo = displayable(photo, db_->filename(db_->photos()[photo_idx_]));
+
+            // The current photo first, if it is not done yet
+            prefetch();
+
             reload = false;
             redraw = true;
         }
@@ -74,37 +172,79 @@ void GUI::run()
 
             photo.copyTo(canvas(cv::Rect(cv::Point(0, 0), cv::Size(photo.cols, photo.rows))));
 
-            cv::putText(canvas, typed, cv::Point(10, 20),  cv::FONT_HERSHEY_COMPLEX_SMALL, 1, cv::Scalar(0, 0, 255), 1);
-            cv::putText(canvas, concept, cv::Point(10, 40),  cv::FONT_HERSHEY_COMPLEX_SMALL, 1, cv::Scalar(255, 0, 0), 1);
+            drawTyped(canvas, typed, completions);
+
+            std::ostringstream status;
+            status << remaining_ << " remaining";
+            if (filtered_)
+                status << " of '" << filter_text_ << "'";
+            cv::putText(canvas, status.str(), cv::Point(photo.cols + 10, canvas.rows - 10),
+                        cv::FONT_HERSHEY_COMPLEX_SMALL, 0.7, cv::Scalar(200, 200, 200), 1);
+            cv::putText(canvas, message, cv::Point(photo.cols + 10, canvas.rows - 30),
+                        cv::FONT_HERSHEY_COMPLEX_SMALL, 0.7, cv::Scalar(0, 0, 255), 1);
 
             cv::imshow("photo", canvas);
+            redraw = false;
+
+            if (navigated)
+            {
+                first_frame_ms.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t_key).count());
+                navigated = false;
+            }
         }
 
-        unsigned char key = cv::waitKey();
+        // Poll for the decode while waiting for a key, such that keys typed meanwhile are handled at once
+        int ret = cv::waitKey(decoding ? DECODE_POLL_MS : 0);
+        if (ret < 0)
+        {
+            if (decoding && cache_.tryGet(photo_idx_, photo))
+            {
+                photo = displayable(photo, db_->filename(db_->photos()[photo_idx_]));
+                decoding = false;
+                redraw = true;
+            }
+            continue;
+        }
+
+        unsigned char key = ret;
+        Clock::time_point key_time = Clock::now();
+        redraw = true;
+        message.clear();
 
 //        std::cout << (int)key << std::endl;
 
         if (key == 27)  // ESC
+        {
+            printTimes("Time to first frame", first_frame_ms);
             return;
+        }
         else if (key == 81) // Left-Arrow
         {
             // Set current photo to done
-            PhotoData& pdata = db_->photos()[photo_idx_];
-            pdata.setDone();
+            setDone(photo_idx_);
 
             if (photo_idx_ > 0)
                 --photo_idx_;
+            direction_ = -1;
             reload = true;
+            navigated = true;
+            t_key = key_time;
         }
         else if (key == 83) // Right-Arrow
         {
             // Set current photo to done
-            PhotoData& pdata = db_->photos()[photo_idx_];
-            pdata.setDone();
-
+            setDone(photo_idx_);
 
             if (photo_idx_ + 1 < db_->photos().size())
                 ++photo_idx_;
+            direction_ = 1;
+            reload = true;
+            navigated = true;
+            t_key = key_time;
+        }
+        else if (key == 82) // Up-Arrow
+        {
+            runGrid(typed);
             reload = true;
         }
         else if (key == 8) // Backspace
@@ -112,6 +252,15 @@ void GUI::run()
             if (!typed.empty())
                 typed.pop_back();
         }
+        else if (key == 10 && !typed.empty() && typed[0] == '?') // Enter
+        {
+            // '?QUERY' keeps Tab and Page-Up to the photos that match, '?' alone lets go
+            std::string error;
+            if (setFilter(typed.substr(1), error))
+                typed.clear();
+            else
+                message = error;
+        }
         else if (key == 10) // Enter
         {
             Id tag_id;
@@ -120,28 +269,23 @@ void GUI::run()
                 tag_id = db_->addConcept(concept);
             }
 
-            PhotoData& pdata = db_->photos()[photo_idx_];
-            pdata.addTag(tag_id);
+            addTag(photo_idx_, tag_id);
 
             typed.clear();
         }
-        else if (key == 9) // Tab
+        else if (key == 9 || key == 85) // Tab, Page-Up
         {
             // Set current photo to done
-            PhotoData& pdata = db_->photos()[photo_idx_];
-            pdata.setDone();
+            setDone(photo_idx_);
 
-            Id new_idx = photo_idx_ + 1;
-            while(new_idx < db_->photos().size())
+            Id new_idx = (key == 9 ? nextToDo(photo_idx_) : previousToDo(photo_idx_));
+            if (new_idx < db_->photos().size())
             {
-                const PhotoData& pdata = db_->photos()[new_idx];
-                if (pdata.tags().empty() && !pdata.isDone())
-                {
-                    photo_idx_ = new_idx;
-                    reload = true;
-                    break;
-                }
-                ++new_idx;
+                photo_idx_ = new_idx;
+                direction_ = (key == 9 ? 1 : -1);
+                reload = true;
+                navigated = true;
+                t_key = key_time;
             }
         }
         else
@@ -149,28 +293,353 @@ void GUI::run()
             typed += key;
         }
 
-        concept.clear();
-        if (!typed.empty())
+        completeConcept(typed, completions);
+        concept = (completions.empty() ? std::string() : completions[0]);
+    }
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Id GUI::nextToDo(Id idx)
+{
+    const Bitmap& to_do = db_->photosToDo();
+
+    // Leapfrog: each set skips ahead to the next photo of the other one, until both agree
+    uint32_t id = idx + 1;
+    while(to_do.next(id, id))
+    {
+        uint32_t match;
+        if (!filtered_)
+            return id;
+        if (!filter_.next(id, match))
+            break;
+        if (match == id)
+            return id;
+
+        id = match;
+    }
+
+    return db_->photos().size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Id GUI::previousToDo(Id idx)
+{
+    const Bitmap& to_do = db_->photosToDo();
+
+    uint32_t id = idx - 1;
+    while(idx > 0 && to_do.previous(id, id))
+    {
+        uint32_t match;
+        if (!filtered_)
+            return id;
+        if (!filter_.previous(id, match))
+            break;
+        if (match == id)
+            return id;
+
+        id = match;
+    }
+
+    return db_->photos().size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool GUI::setFilter(const std::string& text, std::string& error)
+{
+    if (text.empty())
+    {
+        filtered_ = false;
+        filter_ = Bitmap();
+        filter_text_.clear();
+        countRemaining();
+        return true;
+    }
+
+    Query query;
+    if (!query.parse(*db_, text, error))
+        return false;
+
+    std::vector<Id> ids;
+    query.run(*db_, ids);
+
+    // Photos only leave the to-do set when they change, so the result stays right for those still in it
+    filtered_ = true;
+    filter_ = Bitmap();
+    for(Id id : ids)
+        filter_.add(id);
+    filter_text_ = text;
+
+    countRemaining();
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::countRemaining()
+{
+    if (filtered_)
+    {
+        Bitmap both;
+        Bitmap::intersect(db_->photosToDo(), filter_, both);
+        remaining_ = both.cardinality();
+    }
+    else
+    {
+        remaining_ = db_->photosToDo().cardinality();
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool GUI::isRemaining(Id id)
+{
+    return db_->photosToDo().contains(id) && (!filtered_ || filter_.contains(id));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::setDone(Id id)
+{
+    if (isRemaining(id))
+        --remaining_;
+
+    db_->setPhotoDone(db_->photo(id));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::addTag(Id id, Id tag)
+{
+    if (isRemaining(id))
+        --remaining_;
+
+    db_->addPhotoTag(db_->photo(id), tag);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::prefetch()
+{
+    const PhotoStore& photos = db_->photos();
+
+    // The current photo is only queued while the embedded preview stands in for it
+    std::vector<Id> ids(1, photo_idx_);
+    for(unsigned int i = 1; i <= PREFETCH_AHEAD; ++i)
+    {
+        long idx = (long)photo_idx_ + (long)i * direction_;
+        if (idx >= 0 && idx < (long)photos.size())
+            ids.push_back(idx);
+
+        // Tab is as likely as the arrow keys
+        if (i == 1)
+        {
+            Id to_do = nextToDo(photo_idx_);
+            if (to_do < photos.size())
+                ids.push_back(to_do);
+        }
+    }
+
+    for(unsigned int i = 1; i <= PREFETCH_BEHIND; ++i)
+    {
+        long idx = (long)photo_idx_ - (long)i * direction_;
+        if (idx >= 0 && idx < (long)photos.size())
+            ids.push_back(idx);
+    }
+
+    // Workers must not read the database, which the GUI changes meanwhile
+    std::vector<PhotoSource> sources;
+    for(Id id : ids)
+        sources.push_back(source(id));
+
+    cache_.prefetch(sources);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PhotoSource GUI::source(Id id) const
+{
+    const PhotoData& pdata = db_->photos()[id];
+
+    PhotoSource s;
+    s.id = id;
+    s.md5sum = pdata.md5sum;
+    s.filename = db_->photoPrefixPath() + db_->filename(pdata);
+    return s;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::completeConcept(const std::string& typed, std::vector<std::string>& completions)
+{
+    completions.clear();
+    if (typed.empty() || typed[0] == '?')
+        return;
+
+    // An exact match comes first, such that a concept can be chosen while a more used one extends it
+    if (db_->conceptExists(typed))
+        completions.push_back(typed);
+
+    std::vector<Id> ids;
+    db_->completeConcept(typed, NUM_COMPLETIONS, ids);
+    for(Id id : ids)
+    {
+        if (db_->getConcept(id) != typed && completions.size() < NUM_COMPLETIONS)
+            completions.push_back(db_->getConcept(id));
+    }
+
+    if (completions.empty())
+        completions.push_back(typed);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::runGrid(std::string& typed)
+{
+    Id n = db_->photos().size();
+    Id page_size = GRID_COLS * GRID_ROWS;
+    Id cursor = photo_idx_;
+    std::set<Id> selected;
+    std::vector<std::string> completions;
+
+    while(true)
+    {
+        completeConcept(typed, completions);
+        std::string concept = (completions.empty() ? std::string() : completions[0]);
+        drawGrid(cursor, selected, typed, completions);
+
+        unsigned char key = cv::waitKey();
+
+        if (key == 27)  // ESC
+            break;
+        else if (key == 81) // Left-Arrow
+        {
+            if (cursor > 0)
+                --cursor;
+        }
+        else if (key == 83) // Right-Arrow
+        {
+            if (cursor + 1 < n)
+                ++cursor;
+        }
+        else if (key == 82) // Up-Arrow
+        {
+            if (cursor >= GRID_COLS)
+                cursor -= GRID_COLS;
+        }
+        else if (key == 84) // Down-Arrow
+        {
+            if (cursor + GRID_COLS < n)
+                cursor += GRID_COLS;
+        }
+        else if (key == 85) // Page-Up
+        {
+            cursor = (cursor >= page_size ? cursor - page_size : 0);
+        }
+        else if (key == 86) // Page-Down
+        {
+            cursor = std::min(cursor + page_size, n - 1);
+        }
+        else if (key == 9) // Tab
+        {
+            // Select or unselect, and go on
+            if (!selected.erase(cursor))
+                selected.insert(cursor);
+
+            if (cursor + 1 < n)
+                ++cursor;
+        }
+        else if (key == 8) // Backspace
         {
-            for(const std::string& s : db_->concepts())
+            if (!typed.empty())
+                typed.pop_back();
+        }
+        else if (key == 10) // Enter
+        {
+            // Tag the selected photos, or the one at the cursor if none is
+            if (!concept.empty())
             {
-                if (s.size() >= typed.size() && s.substr(0, typed.size()) == typed)
-                {
-                    concept = s;
-                    redraw = true;
-                    break;
-                }
-            }
+                Id tag_id;
+                if (!db_->getConceptId(concept, tag_id))
+                    tag_id = db_->addConcept(concept);
+
+                if (selected.empty())
+                    selected.insert(cursor);
+
+                for(Id id : selected)
+                    addTag(id, tag_id);
 
-            if (concept.empty())
-                concept = typed;
+                selected.clear();
+                typed.clear();
+            }
         }
         else
         {
-
+            typed += key;
         }
-
     }
 
+    photo_idx_ = cursor;
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+void GUI::drawGrid(Id cursor, const std::set<Id>& selected, const std::string& typed,
+                   const std::vector<std::string>& completions) const
+{
+    const PhotoStore& photos = db_->photos();
+
+    Id page_size = GRID_COLS * GRID_ROWS;
+    Id first = cursor / page_size * page_size;
+    int cell = THUMB_SIZE + GRID_SPACING;
+    int grid_width = GRID_COLS * cell;
+
+    cv::Mat canvas(GRID_HEADER + GRID_ROWS * cell, grid_width + 300, CV_8UC3, cv::Scalar(20, 20, 20));
+
+    // Copied from the mapped atlas, without decoding anything
+    for(Id id = first; id < first + page_size && id < photos.size(); ++id)
+    {
+        Id i = id - first;
+        int x = GRID_SPACING / 2 + (i % GRID_COLS) * cell;
+        int y = GRID_HEADER + GRID_SPACING / 2 + (i / GRID_COLS) * cell;
+        cv::Rect rect(x, y, THUMB_SIZE, THUMB_SIZE);
+
+        cv::Mat thumb = thumbnails_.get(photos[id]);
+        if (thumb.data)
+            thumb.copyTo(canvas(rect));
+        else
+            cv::rectangle(canvas, rect, cv::Scalar(60, 60, 60), 1);
+
+        if (!photos[id].tags().empty())
+            cv::rectangle(canvas, cv::Rect(rect.x + 2, rect.y + 2, 6, 6), cv::Scalar(0, 0, 255), -1);
+
+        if (selected.count(id))
+            cv::rectangle(canvas, cv::Rect(rect.x - 2, rect.y - 2, THUMB_SIZE + 4, THUMB_SIZE + 4),
+                          cv::Scalar(0, 255, 0), 2);
+
+        if (id == cursor)
+            cv::rectangle(canvas, cv::Rect(rect.x - 4, rect.y - 4, THUMB_SIZE + 8, THUMB_SIZE + 8),
+                          cv::Scalar(255, 0, 0), 1);
+    }
+
+    drawTyped(canvas, typed, completions);
+
+    std::ostringstream status;
+    status << "Page " << (first / page_size + 1) << "/" << ((photos.size() + page_size - 1) / page_size) << ", "
+           << selected.size() << " selected, " << remaining_ << " remaining";
+    cv::putText(canvas, status.str(), cv::Point(grid_width + 10, 20), cv::FONT_HERSHEY_COMPLEX_SMALL, 0.7,
+                cv::Scalar(200, 200, 200), 1);
+
+    int y_tag = 60;
+    for(Id tag_id : photos[cursor].tags())
+    {
+        cv::putText(canvas, db_->getConcept(tag_id), cv::Point(grid_width + 10, y_tag),
+                    cv::FONT_HERSHEY_COMPLEX_SMALL, 0.7, cv::Scalar(0, 0, 255), 1);
+        y_tag += 20;
+    }
+
+    cv::imshow("photo", canvas);
+}
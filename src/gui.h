@@ -2,8 +2,14 @@
 #define PHOTO_MANAGER_GUI_H_
 
 #include <vector>
+#include <set>
+#include <string>
 #include <opencv2/core/core.hpp>
 
+#include "photo_cache.h"
+#include "preview_cache.h"
+#include "thumbnail_atlas.h"
+
 class PhotoDatabase;
 
 class GUI
@@ -11,7 +17,8 @@ class GUI
 
 public:
 
-    GUI(PhotoDatabase* db, unsigned int photo_idx = 0);
+    // Previews and thumbnails are kept next to the database file
+    GUI(PhotoDatabase* db, const std::string& database_filename, unsigned int photo_idx = 0);
 
     ~GUI();
 
@@ -23,14 +30,60 @@ private:
 
     unsigned int photo_idx_;
 
+    // +1 or -1, the way the user last moved
+    int direction_;
+
+    PreviewCache previews_;
+
+    PhotoCache cache_;
+
+    ThumbnailAtlas thumbnails_;
+
+    // Photos matching the query typed as '?QUERY', to which Tab and Page-Up keep
+    bool filtered_;
+
+    std::string filter_text_;
+
+    Bitmap filter_;
+
+    // Photos that are neither tagged nor done, and match the filter if there is one
+    unsigned long remaining_;
+
+    // The next photo after 'idx' that is neither tagged nor done and matches the filter (what Tab goes to),
+    // or the number of photos if there is none
+    Id nextToDo(Id idx);
+
+    // The same before 'idx' (what Page-Up goes to)
+    Id previousToDo(Id idx);
+
+    // Returns false, with a message in 'error', if 'text' is not a valid query. An empty one removes the
+    // filter.
+    bool setFilter(const std::string& text, std::string& error);
+
+    void countRemaining();
+
+    bool isRemaining(Id id);
+
+    // Change photos through these, which keep 'remaining_' up to date
+    void setDone(Id id);
+
+    void addTag(Id id, Id tag);
+
+    // Decodes the current photo and those around it, ahead in the direction the user moves
+    void prefetch();
 
-//    // Cache (circular buffer)
+    PhotoSource source(Id id) const;
 
-//    unsigned int cache_current_idx_;
+    // Concepts 'typed' may stand for, the one Enter applies first: 'typed' if it is one, and otherwise the
+    // most used concept that starts with it, or 'typed' as a new one. Empty if nothing is typed.
+    void completeConcept(const std::string& typed, std::vector<std::string>& completions);
 
-//    unsigned int cache_break_idx_;
+    // Pages of thumbnails to select photos from and tag them all at once. Returns with the current photo
+    // set to the one at the cursor.
+    void runGrid(std::string& typed);
 
-//    std::vector<cv::Mat> photo_cache_;
+    void drawGrid(Id cursor, const std::set<Id>& selected, const std::string& typed,
+                  const std::vector<std::string>& completions) const;
 
 };
 
@@ -0,0 +1,311 @@
+#ifndef PHOTO_MANAGER_HASH_INDEX_H_
+#define PHOTO_MANAGER_HASH_INDEX_H_
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <stdint.h>
+
+#include "parallel_for.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// FNV-1a
+inline uint64_t hashBytes(const char* data, std::size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(std::size_t i = 0; i < size; ++i)
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ull;
+    return h;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+struct HashSlot
+{
+    uint32_t hash;
+    uint32_t id;    // Id + 1, zero if the slot is empty
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Open-addressing hash table (linear probing) from keys to ids. Only the ids and 32 bits of their hash
+// are stored; the key of an id is looked up through the 'key_of' function passed to each call, such that
+// keys that already live elsewhere (e.g., in the photos) are not duplicated. An id maps to at most one
+// key at a time, and ids must fit in 32 bits.
+
+template<typename Key, typename Hash>
+class HashIndex
+{
+
+public:
+
+    HashIndex() : size_(0), mask_(0) {}
+
+    template<typename KeyOf>
+    bool find(const Key& key, const KeyOf& key_of, unsigned long& id) const
+    {
+        if (slots_.empty())
+            return false;
+
+        uint32_t h = hash(key);
+        for(std::size_t i = h & mask_; slots_[i].id != 0; i = (i + 1) & mask_)
+        {
+            if (slots_[i].hash == h && key_of(slots_[i].id - 1) == key)
+            {
+                id = slots_[i].id - 1;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Maps the current key of 'id' to 'id', replacing the id it was mapped to before
+    template<typename KeyOf>
+    void insert(unsigned long id, const KeyOf& key_of)
+    {
+        if ((size_ + 1) * 8 > slots_.size() * 7)
+            rehash(slots_.empty() ? 16 : 2 * slots_.size());
+
+        const Key& key = key_of(id);
+        uint32_t h = hash(key);
+
+        std::size_t i = h & mask_;
+        for(; slots_[i].id != 0; i = (i + 1) & mask_)
+        {
+            if (slots_[i].hash == h && key_of(slots_[i].id - 1) == key)
+            {
+                slots_[i].id = id + 1;
+                return;
+            }
+        }
+
+        slots_[i].hash = h;
+        slots_[i].id = id + 1;
+        ++size_;
+    }
+
+    // Removes the current key of 'id', if it is mapped to 'id'. Must be called before the key changes.
+    template<typename KeyOf>
+    void erase(unsigned long id, const KeyOf& key_of)
+    {
+        if (slots_.empty())
+            return;
+
+        uint32_t h = hash(key_of(id));
+
+        std::size_t i = h & mask_;
+        for(; slots_[i].id != id + 1; i = (i + 1) & mask_)
+        {
+            if (slots_[i].id == 0)
+                return;
+        }
+
+        // Shift later entries of the probe sequence back, such that no tombstones are needed
+        for(std::size_t j = (i + 1) & mask_; slots_[j].id != 0; j = (j + 1) & mask_)
+        {
+            std::size_t home = slots_[j].hash & mask_;
+            if (((j - home) & mask_) >= ((j - i) & mask_))
+            {
+                slots_[i] = slots_[j];
+                i = j;
+            }
+        }
+
+        slots_[i].id = 0;
+        --size_;
+    }
+
+    // Makes room for 'n' entries without rehashing
+    void reserve(std::size_t n)
+    {
+        std::size_t n_slots = 16;
+        while(n * 8 > n_slots * 7)
+            n_slots *= 2;
+
+        if (n_slots > slots_.size())
+            rehash(n_slots);
+    }
+
+    // Replaces the contents by the keys of ids 0 .. n - 1, mapped to their ids (later ids win on equal keys,
+    // as with insert()), using 'num_threads' threads
+    template<typename KeyOf>
+    void build(std::size_t n, const KeyOf& key_of, unsigned int num_threads)
+    {
+        clear();
+        reserve(n);
+
+        std::vector<uint32_t> hashes(n);
+        parallelFor(n, num_threads, [&](std::size_t begin, std::size_t end)
+        {
+            for(std::size_t id = begin; id < end; ++id)
+                hashes[id] = hash(key_of(id));
+        });
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Group the ids by the region of the table their probe sequences start in, keeping them in order
+
+        std::size_t n_regions = 1;
+        while(n_regions < 8 * num_threads && n_regions * 1024 < slots_.size())
+            n_regions *= 2;
+        std::size_t region_size = slots_.size() / n_regions;
+
+        std::vector<std::size_t> region_begin(n_regions + 1, 0);
+        for(uint32_t h : hashes)
+            ++region_begin[(h & mask_) / region_size + 1];
+        for(std::size_t r = 0; r < n_regions; ++r)
+            region_begin[r + 1] += region_begin[r];
+
+        std::vector<uint32_t> ids(n);
+        std::vector<std::size_t> next(region_begin.begin(), region_begin.end() - 1);
+        for(std::size_t id = 0; id < n; ++id)
+            ids[next[(hashes[id] & mask_) / region_size]++] = id;
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Fill the regions concurrently. An id whose probe sequence would leave its region is deferred; the
+        // later ids of the region with the same key then run into the end of the region as well.
+
+        std::vector<std::vector<uint32_t> > deferred(n_regions);
+        std::vector<std::size_t> added(n_regions, 0);
+
+        parallelFor(n_regions, num_threads, [&](std::size_t begin, std::size_t end)
+        {
+            for(std::size_t r = begin; r < end; ++r)
+            {
+                std::size_t region_end = (r + 1) * region_size;
+                for(std::size_t k = region_begin[r]; k < region_begin[r + 1]; ++k)
+                {
+                    uint32_t id = ids[k];
+                    std::size_t i = insertSlot(id, hashes[id], key_of, region_end);
+                    if (i == region_end)
+                        deferred[r].push_back(id);
+                    else if (slots_[i].id == 0)
+                    {
+                        slots_[i].hash = hashes[id];
+                        slots_[i].id = id + 1;
+                        ++added[r];
+                    }
+                    else
+                        slots_[i].id = id + 1;
+                }
+            }
+        });
+
+        for(std::size_t added : added)
+            size_ += added;
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Deferred ids may probe into the following regions
+
+        std::vector<uint32_t> rest;
+        for(std::vector<uint32_t>& d : deferred)
+            rest.insert(rest.end(), d.begin(), d.end());
+        std::sort(rest.begin(), rest.end());
+
+        for(uint32_t id : rest)
+        {
+            std::size_t i = insertSlot(id, hashes[id], key_of, slots_.size() + 1);
+            if (slots_[i].id == 0)
+            {
+                slots_[i].hash = hashes[id];
+                ++size_;
+            }
+            slots_[i].id = id + 1;
+        }
+    }
+
+    void clear()
+    {
+        slots_.clear();
+        size_ = 0;
+        mask_ = 0;
+    }
+
+    std::size_t size() const { return size_; }
+
+    // Raw slots, such that an index can be saved along with its keys and restored without rehashing
+    const std::vector<HashSlot>& slots() const { return slots_; }
+
+    // Restores slots saved from an index with the same hash function, whose ids are all below 'max_id'.
+    // Returns false (leaving the index empty) if they cannot be valid.
+    bool assign(const HashSlot* slots, std::size_t n_slots, std::size_t max_id)
+    {
+        clear();
+
+        if (n_slots < 16 || (n_slots & (n_slots - 1)) != 0)
+            return false;
+
+        std::size_t size = 0;
+        for(std::size_t i = 0; i < n_slots; ++i)
+        {
+            if (slots[i].id > max_id)
+                return false;
+            size += (slots[i].id != 0);
+        }
+
+        // Probing relies on empty slots
+        if (size * 8 > n_slots * 7)
+            return false;
+
+        slots_.assign(slots, slots + n_slots);
+        size_ = size;
+        mask_ = n_slots - 1;
+        return true;
+    }
+
+    std::size_t memoryUsage() const { return slots_.capacity() * sizeof(HashSlot); }
+
+private:
+
+    std::vector<HashSlot> slots_;
+
+    std::size_t size_;
+
+    std::size_t mask_;
+
+    static uint32_t hash(const Key& key)
+    {
+        uint64_t h = Hash()(key);
+        return (uint32_t)(h ^ (h >> 32));
+    }
+
+    // Returns the slot that holds the key of 'id' or the empty slot where it belongs, or 'stop' if the probe
+    // sequence reaches slot 'stop' first
+    template<typename KeyOf>
+    std::size_t insertSlot(unsigned long id, uint32_t h, const KeyOf& key_of, std::size_t stop) const
+    {
+        const Key& key = key_of(id);
+
+        std::size_t i = h & mask_;
+        while(slots_[i].id != 0 && !(slots_[i].hash == h && key_of(slots_[i].id - 1) == key))
+        {
+            if (++i == stop)
+                break;
+            i &= mask_;
+        }
+
+        return i;
+    }
+
+    void rehash(std::size_t n_slots)
+    {
+        std::vector<HashSlot> old(n_slots, HashSlot());
+        old.swap(slots_);
+        mask_ = n_slots - 1;
+
+        for(const HashSlot& slot : old)
+        {
+            if (slot.id == 0)
+                continue;
+
+            std::size_t i = slot.hash & mask_;
+            while(slots_[i].id != 0)
+                i = (i + 1) & mask_;
+            slots_[i] = slot;
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,190 @@
+#include "io_uring.h"
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+IoUring::IoUring() : fd_(-1), entries_(0), to_submit_(0), in_flight_(0), broken_(false), sq_ring_(MAP_FAILED), sq_ring_size_(0),
+    cq_ring_(MAP_FAILED), cq_ring_size_(0), sqes_((io_uring_sqe*)MAP_FAILED), sqes_size_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+IoUring::~IoUring()
+{
+    if (sqes_ != MAP_FAILED)
+        munmap(sqes_, sqes_size_);
+
+    if (cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_)
+        munmap(cq_ring_, cq_ring_size_);
+
+    if (sq_ring_ != MAP_FAILED)
+        munmap(sq_ring_, sq_ring_size_);
+
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool IoUring::init(unsigned int entries)
+{
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0)
+        return false;
+
+    // IORING_OP_READ came with 5.6, as did probing; before, every read would fail with EINVAL
+    std::vector<char> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+    io_uring_probe* probe = (io_uring_probe*)probe_buffer.data();
+    if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, 256) < 0 ||
+        probe->last_op < IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+    {
+        return false;
+    }
+
+    entries_ = params.sq_entries;
+
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+    // Since 5.4 both rings share a single mapping
+    bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap)
+        sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+    sq_ring_ = mmap(0, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    if (sq_ring_ == MAP_FAILED)
+        return false;
+
+    if (single_mmap)
+        cq_ring_ = sq_ring_;
+    else
+        cq_ring_ = mmap(0, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+
+    if (cq_ring_ == MAP_FAILED)
+        return false;
+
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = (io_uring_sqe*)mmap(0, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED)
+        return false;
+
+    char* sq = (char*)sq_ring_;
+    sq_tail_ = (unsigned int*)(sq + params.sq_off.tail);
+    sq_mask_ = (unsigned int*)(sq + params.sq_off.ring_mask);
+    sq_array_ = (unsigned int*)(sq + params.sq_off.array);
+
+    char* cq = (char*)cq_ring_;
+    cq_head_ = (unsigned int*)(cq + params.cq_off.head);
+    cq_tail_ = (unsigned int*)(cq + params.cq_off.tail);
+    cq_mask_ = (unsigned int*)(cq + params.cq_off.ring_mask);
+    cqes_ = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool IoUring::read(int fd, void* buffer, unsigned int size, unsigned long offset, unsigned long user_data)
+{
+    if (broken_ || in_flight_ + to_submit_ >= entries_)
+        return false;
+
+    // Only this thread writes the tail, so a plain load suffices
+    unsigned int tail = *sq_tail_;
+    unsigned int index = tail & *sq_mask_;
+
+    io_uring_sqe* sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buffer;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+
+    sq_array_[index] = index;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+    ++to_submit_;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool IoUring::wait(unsigned long& user_data, int& result)
+{
+    if (broken_ || in_flight_ + to_submit_ == 0)
+        return false;
+
+    while(true)
+    {
+        if (reap(user_data, result))
+            return true;
+
+        int r = syscall(__NR_io_uring_enter, fd_, to_submit_, 1, IORING_ENTER_GETEVENTS, 0, 0);
+        if (r < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+
+            // Should not happen with a valid ring
+            user_data = 0;
+            result = -errno;
+            shutdown();
+            return false;
+        }
+
+        in_flight_ += r;
+        to_submit_ -= r;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool IoUring::reap(unsigned long& user_data, int& result)
+{
+    unsigned int head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        return false;
+
+    io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+    user_data = cqe->user_data;
+    result = cqe->res;
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    --in_flight_;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void IoUring::shutdown()
+{
+    broken_ = true;
+
+    // Queued reads are never submitted now
+    to_submit_ = 0;
+
+    // Let the submitted ones finish, such that their buffers may be reused
+    while(in_flight_ > 0)
+    {
+        unsigned long user_data;
+        int result;
+        if (reap(user_data, result))
+            continue;
+
+        if (syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS, 0, 0) < 0 && errno != EINTR)
+            break;
+    }
+}
@@ -0,0 +1,93 @@
+#ifndef PHOTO_MANAGER_IO_URING_H_
+#define PHOTO_MANAGER_IO_URING_H_
+
+#include <cstddef>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Minimal io_uring wrapper (raw system calls, no liburing) that only supports reads. Not thread-safe.
+
+class IoUring
+{
+
+public:
+
+    IoUring();
+
+    ~IoUring();
+
+    IoUring(const IoUring&) = delete;
+
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Returns false if the kernel does not support io_uring or its read operation (before 5.6), or it is
+    // disabled, e.g. by seccomp
+    bool init(unsigned int entries);
+
+    // Queues a read; it is submitted by the next call to wait(). Returns false if the queue is full or the
+    // ring is broken.
+    bool read(int fd, void* buffer, unsigned int size, unsigned long offset, unsigned long user_data);
+
+    // Submits all queued reads and waits for one completion. 'result' is the number of bytes read or a
+    // negative errno. Returns false if nothing is in flight, or if the ring broke down, with a negative errno
+    // in 'result'. A broken ring takes no more reads; the reads it had submitted are waited for first, but
+    // those still in flight if that fails too may write into their buffers at any time (see inFlight()).
+    bool wait(unsigned long& user_data, int& result);
+
+    unsigned int capacity() const { return entries_; }
+
+    bool broken() const { return broken_; }
+
+    // Reads submitted and not completed yet
+    unsigned int inFlight() const { return in_flight_; }
+
+private:
+
+    int fd_;
+
+    unsigned int entries_;
+
+    unsigned int to_submit_;
+
+    unsigned int in_flight_;
+
+    bool broken_;
+
+    void* sq_ring_;
+
+    std::size_t sq_ring_size_;
+
+    void* cq_ring_;
+
+    std::size_t cq_ring_size_;
+
+    io_uring_sqe* sqes_;
+
+    std::size_t sqes_size_;
+
+    unsigned int* sq_tail_;
+
+    unsigned int* sq_mask_;
+
+    unsigned int* sq_array_;
+
+    unsigned int* cq_head_;
+
+    unsigned int* cq_tail_;
+
+    unsigned int* cq_mask_;
+
+    io_uring_cqe* cqes_;
+
+    // Takes a completion if there is one
+    bool reap(unsigned long& user_data, int& result);
+
+    // Stops using the ring after an error
+    void shutdown();
+
+};
+
+#endif
@@ -1,10 +1,14 @@
 #include <iostream>
 #include <set>
-#include <boost/filesystem.hpp>
+#include <thread>
+#include <algorithm>
 
 #include "photo_database.h"
 #include "gui.h"
-#include "md5sum.h"
+#include "scanner.h"
+#include "watcher.h"
+#include "commands.h"
+#include "server.h"
 
 // ----------------------------------------------------------------------------------------------------
 
@@ -14,191 +18,165 @@ void printUsage()
     std::cerr << "usage: photo_manager <DATABASE FILE> <IMAGE DIRECTORY> <COMMAND> [ARGS...]" << std::endl;
     std::cerr <<  std::endl;
     std::cerr << "    gui [PHOTO IDX]                Start annotation gui" << std::endl;
-    std::cerr << "    scan                           Scans for images and adds new images to the database" << std::endl;
-    std::cerr << "    search <TAG1> - <TAG2> - ...   Search for photos containing all these tags" << std::endl;
+    std::cerr << "    scan [OPTIONS]                 Scans for images and adds new images to the database" << std::endl;
+    std::cerr << "        --jobs N                   Number of hashing threads" << std::endl;
+    std::cerr << "        --direct                   Read with O_DIRECT, bypassing the page cache" << std::endl;
+    std::cerr << "        --io threads|uring         I/O backend (default: threads)" << std::endl;
+    std::cerr << "        --queue-depth N            Reads in flight for the uring backend (default: 32)" << std::endl;
+    std::cerr << "        --order none|inode|extent  Read files in (approximate) on-disk order" << std::endl;
+    std::cerr << "        --previews                 Make the previews the gui shows afterwards" << std::endl;
+    std::cerr << "        --thumbnails               Make the thumbnails of the gui's grid (Up-Arrow) afterwards" << std::endl;
+    std::cerr << "        --hashes                   Make the perceptual hashes of new photos afterwards (see dupes)" << std::endl;
+    std::cerr << "    watch [--debounce MS] [OPTIONS]  Scans, then keeps the database up to date as files change" << std::endl;
+    std::cerr << "    search [--explain] <QUERY>     Search for photos, e.g. 'beach AND (sunset OR NOT is:done)'" << std::endl;
+    std::cerr << "                                   Operators: AND (or -), OR, NOT, ( ), is:done, is:untagged" << std::endl;
+    std::cerr << "    tag <FILE> <CONCEPT>           Tag a photo" << std::endl;
+    std::cerr << "    stat                           Print the number of photos, tags and so on" << std::endl;
+    std::cerr << "    convert text|binary [FILE]     Writes the database in the given format to FILE (default: in place)" << std::endl;
+    std::cerr << "    previews [--jobs N] [--max-size MB]  Make missing previews and keep at most MB of them (default: 1024)" << std::endl;
+    std::cerr << "    dupes [--distance D] [--jobs N]  Print groups of near-duplicate photos, whose perceptual hashes" << std::endl;
+    std::cerr << "                                   differ in at most D of 64 bits (default: 4)" << std::endl;
+    std::cerr << "    serve [--threads N]            Keep the database loaded and answer search, tag, stat and scan" << std::endl;
+    std::cerr << "                                   from other invocations over a socket next to the database" << std::endl;
     std::cerr << std::endl;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-void search(const PhotoDatabase& db, const std::vector<std::string>& args)
+int main(int argc, char **argv)
 {
-    if (args.empty())
+    if (argc < 4)
     {
         printUsage();
-        return;
+        return 1;
     }
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Parse tags from command-line arguments
+    std::string database_filename = argv[1];
+    std::string image_dir = argv[2];
+    std::string command = argv[3];
 
-    std::vector<std::string> tags;
-    tags.push_back("");
-    for(unsigned int i = 0; i < args.size(); ++i)
-    {
-        if (args[i] == "-")
-            tags.push_back("");
-        else if (tags.back().empty())
-            tags.back() += args[i];
-        else
-            tags.back() += " " + args[i];
-    }
+    std::vector<std::string> args;
+    for(int i = 4; i < argc; ++i)
+        args.push_back(argv[i]);
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Convert tags to tag ids
+    // Let a running server answer if possible, and otherwise keep out of its way
 
-    bool all_concepts_exist = true;
-    std::vector<Id> tag_ids(tags.size());
-
-    for(unsigned int i = 0 ; i < tags.size(); ++i)
+    std::string socket_filename = socketFilename(database_filename);
+    if (command == "search" || command == "tag" || command == "stat" || command == "scan")
     {
-        Id tag_id;
-        if (!db.getConceptId(tags[i], tag_id))
+        std::vector<std::string> request;
+        request.push_back(image_dir);
+        request.push_back(command);
+        request.insert(request.end(), args.begin(), args.end());
+
+        std::string output;
+        bool ok;
+        if (sendRequest(socket_filename, request, output, ok))
         {
-            std::cout << "Unknown concept: '" << tags[i] << "'" << std::endl;
-            all_concepts_exist = false;
+            std::cout << output << std::flush;
+            return ok ? 0 : 1;
         }
-
-        tag_ids[i] = tag_id;
     }
-
-    if (!all_concepts_exist)
-        return;
-
-    // - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // Search photos
-
-    for(const PhotoData& photo_data : db.photos())
+    else if (serverRunning(socket_filename))
     {
-        bool has_tags = true;
-        for(const Id& tag_id : tag_ids)
-        {
-            if (!photo_data.hasTag(tag_id))
-            {
-                has_tags = false;
-                break;
-            }
-        }
-
-        if (has_tags)
-        {
-            std::cout << db.photoPrefixPath() << photo_data.rel_filename << std::endl;
-        }
+        // The server would not see the changes, and would overwrite them
+        std::cout << "A server is running on " << socket_filename << ", stop it first" << std::endl;
+        return 1;
     }
-}
-
-// ----------------------------------------------------------------------------------------------------
 
-void scan(PhotoDatabase& db, const std::string& image_dir)
-{
-    boost::filesystem::path p(image_dir);
-    boost::filesystem::recursive_directory_iterator it_dir(p);
-    boost::filesystem::recursive_directory_iterator end;
+    // Do not overwrite a database that could not be read
+    PhotoDatabase db;
+    if (!loadDatabase(database_filename, db))
+        return 1;
+    db.setRecordChanges(true);
+    db.setPhotoPrefixPath(image_dir);
 
-    std::set<std::string> photo_exts;
-    photo_exts.insert(".jpg");
-    photo_exts.insert(".png");
-    photo_exts.insert(".jpeg");
+    if (command == "gui")
+    {
+        unsigned int photo_idx_start = 0;
+        if (args.size() > 0)
+            photo_idx_start = atoi(args[0].c_str());
 
-    std::set<std::string> found_exts;
+        GUI gui(&db, database_filename, photo_idx_start);
+        gui.run();
+    }
+    else if (command == "search" || command == "tag" || command == "stat")
+    {
+        bool ok;
+        if (command == "search")
+            ok = searchCommand(db, db.photoPrefixPath(), args, std::cout);
+        else if (command == "tag")
+            ok = tagCommand(db, db.photoPrefixPath(), args, std::cout);
+        else
+            ok = statCommand(db, std::cout);
 
-    int i_photo = 0;
-    while(it_dir != end)
+        if (!ok)
+            return 1;
+    }
+    else if (command == "serve")
     {
-        if (boost::filesystem::is_regular_file(*it_dir))
+        unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+        for(unsigned int i = 0; i + 1 < args.size(); ++i)
         {
-            if (it_dir->path().filename().string()[0] != '.')
-            {
-                std::string ext = it_dir->path().extension().string();
-                std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
-
-                found_exts.insert(ext);
-
-                if (photo_exts.find(ext) != photo_exts.end())
-                {
-                    std::string abs_filename = it_dir->path().string();
-                    std::string rel_filename = abs_filename.substr(image_dir.size() + 1);
-
-                    std::string msum;
-
-                    PhotoData* p = db.findPhotoByFilename(rel_filename);
-                    if (!p)
-                    {
-                        msum = md5sum(abs_filename);
-                        p = db.findPhoto(msum);
-
-                        if (p)
-                        {
-                            std::cout << "File moved: '" << p->rel_filename << "'' -> '" << rel_filename << "'" << std::endl;
-                        }
-                    }
-
-                    if (!p)
-                    {
-                        // New photo
-                        std::cout << "New photo: " << rel_filename << std::endl;
-                        p = db.addPhoto();
-                        p->md5sum = msum;
-                        p->rel_filename = rel_filename;
-                        db.registerPhoto(p);
-                    }
-                    else
-                    {
-                        // Old photo, update filename
-                        p->rel_filename = rel_filename;
-                    }
-
-                    ++i_photo;
-                    if (i_photo % 100 == 0)
-                        std::cout << i_photo << " photos scanned" << std::endl;
-
-//                    std::cout << md5sum(abs_filename) << ": " << abs_filename << std::endl;
-                }
-            }
+            if (args[i] == "--threads")
+                num_threads = atoi(args[i + 1].c_str());
         }
 
-        ++it_dir;
+        if (!serve(db, database_filename, socket_filename, num_threads))
+            return 1;
     }
-}
-
-// ----------------------------------------------------------------------------------------------------
-
-int main(int argc, char **argv)
-{
-    if (argc < 4)
+    else if (command == "scan")
     {
-        printUsage();
-        return 1;
+        ScanOptions opts;
+        parseScanOptions(args, opts);
+        if (!scan(db, image_dir, opts))
+            return 1;
+
+        if (std::find(args.begin(), args.end(), "--previews") != args.end())
+            makePreviews(db, database_filename, opts.num_jobs, std::cout);
+        if (std::find(args.begin(), args.end(), "--thumbnails") != args.end())
+            makeThumbnails(db, database_filename, opts.num_jobs, std::cout);
+        if (std::find(args.begin(), args.end(), "--hashes") != args.end())
+            makePerceptualHashes(db, opts.num_jobs, std::cout);
     }
+    else if (command == "watch")
+    {
+        ScanOptions opts;
+        parseScanOptions(args, opts);
 
-    std::string database_filename = argv[1];
-    std::string image_dir = argv[2];
-    std::string command = argv[3];
-
-    std::vector<std::string> args;
-    for(int i = 4; i < argc; ++i)
-        args.push_back(argv[i]);
-
-    PhotoDatabase db;
-    loadDatabase(database_filename, db);
-    db.setPhotoPrefixPath(image_dir);
+        unsigned int debounce_ms = 2000;
+        for(unsigned int i = 0; i + 1 < args.size(); ++i)
+        {
+            if (args[i] == "--debounce")
+                debounce_ms = atoi(args[i + 1].c_str());
+        }
 
-    if (command == "gui")
+        watch(db, image_dir, database_filename, debounce_ms, opts);
+    }
+    else if (command == "previews")
     {
-        unsigned int photo_idx_start = 0;
-        if (args.size() > 0)
-            photo_idx_start = atoi(args[0].c_str());
-
-        GUI gui(&db, photo_idx_start);
-        gui.run();
+        if (!previewsCommand(db, database_filename, args, std::cout))
+            return 1;
     }
-    else if (command == "search")
+    else if (command == "dupes")
     {
-        search(db, args);
+        if (!dupesCommand(db, db.photoPrefixPath(), args, std::cout))
+            return 1;
     }
-    else if (command == "scan")
+    else if (command == "convert")
     {
-        scan(db, image_dir);
+        if (args.empty() || (args[0] != "text" && args[0] != "binary"))
+        {
+            printUsage();
+            return 1;
+        }
+
+        DatabaseFormat format = (args[0] == "binary" ? DATABASE_BINARY : DATABASE_TEXT);
+        if (args.size() > 1)
+            return writeDatabase(db, args[1], format) ? 0 : 1;
+        else
+            return compactDatabase(db, database_filename, format) ? 0 : 1;
     }
     else
     {
@@ -206,7 +184,8 @@ int main(int argc, char **argv)
         return 0;
     }
 
-    writeDatabase(db, database_filename);
+    // Only what changed is written, see saveDatabase()
+    saveDatabase(db, database_filename);
 
     return 0;
 }
@@ -2,45 +2,353 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sstream>
+#include <algorithm>
 #include <openssl/md5.h>
 
-std::string md5sum(const std::string& filename)
+// O_DIRECT requires the buffer, file offsets and read sizes to be aligned to the logical block size
+static const unsigned long IO_ALIGNMENT = 4096;
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
 {
-    int file_descript = open(filename.c_str(), O_RDONLY);
-    if(file_descript < 0)
-        return "";
 
-    struct stat statbuf;
-    if (fstat(file_descript, &statbuf) < 0)
-        return "";
+inline unsigned long mix(unsigned long h, unsigned long v)
+{
+    h ^= v * 0x87c37b91114253d5ul;
+    h = (h << 31) | (h >> 33);
+    return h * 0x4cf5ad432745937ful;
+}
+
+unsigned long hashBlock(const unsigned char* data, unsigned long size, unsigned long h)
+{
+    unsigned long i = 0;
+    for(; i + 8 <= size; i += 8)
+    {
+        unsigned long v;
+        memcpy(&v, data + i, 8);
+        h = mix(h, v);
+    }
+
+    unsigned long tail = 0;
+    for(; i < size; ++i)
+        tail = (tail << 8) | data[i];
+
+    return mix(h, tail);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Regular files only return short reads at end of file
+ssize_t readChunk(int fd, unsigned char* buffer, unsigned long size, unsigned long offset)
+{
+    while(true)
+    {
+        ssize_t r = pread(fd, buffer, size, offset);
+        if (r >= 0 || errno != EINTR)
+            return r;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
 
-    unsigned long file_size = statbuf.st_size;
+bool readExactly(int fd, unsigned char* buffer, unsigned long size, unsigned long offset)
+{
+    ssize_t r = readChunk(fd, buffer, size, offset);
+    if (r >= 0 && r != (ssize_t)size)
+        errno = EAGAIN; // File was truncated
+
+    return r == (ssize_t)size;
+}
 
-    char* file_buffer = (char*)mmap(0, file_size, PROT_READ, MAP_SHARED, file_descript, 0);
+// ----------------------------------------------------------------------------------------------------
+
+// Value of each hex digit, or 0xff
+struct HexDigits
+{
+    HexDigits()
+    {
+        memset(values, 0xff, sizeof(values));
+        for(int i = 0; i < 10; ++i)
+            values['0' + i] = i;
+        for(int i = 0; i < 6; ++i)
+            values['a' + i] = values['A' + i] = 10 + i;
+    }
 
-    unsigned char result[MD5_DIGEST_LENGTH];
-    MD5((unsigned char*)file_buffer, file_size, result);
+    unsigned char values[256];
+};
 
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string toHex(const unsigned char* data, unsigned int size)
+{
     static char hex[] = "0123456789abcdef";
 
     std::string res;
-    res.resize(MD5_DIGEST_LENGTH * 2);
+    res.resize(size * 2);
 
-    for(int i = 0; i < MD5_DIGEST_LENGTH; i++)
+    for(unsigned int i = 0; i < size; i++)
     {
-        int b = result[i];
+        int b = data[i];
         res[i * 2] = hex[b / 16];
         res[i * 2 + 1] = hex[b % 16];
     }
 
-    close(file_descript);
-
     return res;
 }
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string toHex(const Md5Digest& digest)
+{
+    return toHex(digest.bytes, MD5_DIGEST_SIZE);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool fromHex(const char* hex, std::size_t size, Md5Digest& digest)
+{
+    static const HexDigits digits;
+
+    if (size != 2 * MD5_DIGEST_SIZE)
+        return false;
+
+    unsigned char invalid = 0;
+    for(unsigned int i = 0; i < MD5_DIGEST_SIZE; ++i)
+    {
+        unsigned char hi = digits.values[(unsigned char)hex[2 * i]];
+        unsigned char lo = digits.values[(unsigned char)hex[2 * i + 1]];
+        invalid |= (hi | lo) & 0xf0;
+        digest.bytes[i] = (hi << 4) | (lo & 0x0f);
+    }
+
+    return invalid == 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool fromHex(const std::string& hex, Md5Digest& digest)
+{
+    return fromHex(hex.data(), hex.size(), digest);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FingerprintBuilder::add(const unsigned char* data, unsigned long size)
+{
+    unsigned long n_head = std::min(size, 2 * PARTIAL_HASH_BLOCK_SIZE - head_size_);
+    memcpy(head_ + head_size_, data, n_head);
+    head_size_ += n_head;
+
+    // Keep the last PARTIAL_HASH_BLOCK_SIZE bytes seen
+    if (size >= PARTIAL_HASH_BLOCK_SIZE)
+    {
+        memcpy(tail_, data + size - PARTIAL_HASH_BLOCK_SIZE, PARTIAL_HASH_BLOCK_SIZE);
+        tail_size_ = PARTIAL_HASH_BLOCK_SIZE;
+    }
+    else
+    {
+        unsigned long keep = std::min(tail_size_, PARTIAL_HASH_BLOCK_SIZE - size);
+        memmove(tail_, tail_ + tail_size_ - keep, keep);
+        memcpy(tail_ + keep, data, size);
+        tail_size_ = keep + size;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long FingerprintBuilder::finish(unsigned long file_size)
+{
+    unsigned long h = mix(0x9e3779b97f4a7c15ul, file_size);
+    if (file_size <= 2 * PARTIAL_HASH_BLOCK_SIZE)
+    {
+        h = hashBlock(head_, std::min(head_size_, file_size), h);
+    }
+    else
+    {
+        memcpy(head_ + PARTIAL_HASH_BLOCK_SIZE, tail_, tail_size_);
+        h = hashBlock(head_, PARTIAL_HASH_BLOCK_SIZE + tail_size_, h);
+    }
+
+    reset();
+
+    // Zero means 'unknown' in the database
+    return h == 0 ? 1 : h;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FileHasher::FileHasher(unsigned long chunk_size, bool direct_io)
+    : direct_io_(direct_io), buffer_(0), error_(0), bytes_read_(0), num_reads_(0)
+{
+    chunk_size_ = std::max(chunk_size, 2 * PARTIAL_HASH_BLOCK_SIZE);
+    chunk_size_ = (chunk_size_ + IO_ALIGNMENT - 1) / IO_ALIGNMENT * IO_ALIGNMENT;
+
+    void* buffer;
+    if (posix_memalign(&buffer, IO_ALIGNMENT, chunk_size_) == 0)
+        buffer_ = (unsigned char*)buffer;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FileHasher::~FileHasher()
+{
+    free(buffer_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int FileHasher::openFile(const std::string& filename, bool direct_io, unsigned long& file_size)
+{
+    error_ = 0;
+
+    if (!buffer_)
+    {
+        error_ = ENOMEM;
+        return -1;
+    }
+
+    int fd = -1;
+    if (direct_io)
+    {
+        fd = open(filename.c_str(), O_RDONLY | O_DIRECT);
+
+        // Not all file systems support direct I/O; fall back to buffered reads
+        if (fd < 0 && errno != EINVAL)
+        {
+            error_ = errno;
+            return -1;
+        }
+    }
+
+    if (fd < 0)
+        fd = open(filename.c_str(), O_RDONLY);
+
+    if (fd < 0)
+    {
+        error_ = errno;
+        return -1;
+    }
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0)
+    {
+        fail(fd);
+        return -1;
+    }
+
+    file_size = statbuf.st_size;
+    return fd;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FileHasher::fail(int fd)
+{
+    error_ = errno;
+    close(fd);
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FileHasher::md5sum(const std::string& filename, Md5Digest& md5sum, unsigned long* fingerprint)
+{
+    unsigned long file_size;
+    int fd = openFile(filename, direct_io_, file_size);
+    if (fd < 0)
+        return false;
+
+    bool direct = (fcntl(fd, F_GETFL) & O_DIRECT) != 0;
+    if (!direct)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+
+    fingerprint_.reset();
+
+    unsigned long offset = 0;
+    while(true)
+    {
+        ssize_t n = readChunk(fd, buffer_, chunk_size_, offset);
+        if (n < 0)
+            return fail(fd);
+
+        MD5_Update(&ctx, buffer_, n);
+
+        if (fingerprint)
+            fingerprint_.add(buffer_, n);
+
+        // We will not need these pages again
+        if (!direct)
+            posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
+
+        offset += n;
+        bytes_read_ += n;
+        ++num_reads_;
+
+        if ((unsigned long)n < chunk_size_)
+            break;
+    }
+
+    close(fd);
+
+    if (offset != file_size)
+    {
+        // File was truncated or extended while reading
+        error_ = EAGAIN;
+        return false;
+    }
+
+    MD5_Final(md5sum.bytes, &ctx);
+
+    if (fingerprint)
+        *fingerprint = fingerprint_.finish(file_size);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FileHasher::partialHash(const std::string& filename, unsigned long& hash)
+{
+    // Always buffered: the tail block is not aligned
+    unsigned long file_size;
+    int fd = openFile(filename, false, file_size);
+    if (fd < 0)
+        return false;
+
+    unsigned long n_head = std::min(file_size, 2 * PARTIAL_HASH_BLOCK_SIZE);
+    unsigned long n_tail = 0;
+    if (file_size > n_head)
+    {
+        n_head = PARTIAL_HASH_BLOCK_SIZE;
+        n_tail = PARTIAL_HASH_BLOCK_SIZE;
+    }
+
+    if (!readExactly(fd, buffer_, n_head, 0))
+        return fail(fd);
+
+    if (n_tail > 0 && !readExactly(fd, buffer_ + n_head, n_tail, file_size - n_tail))
+        return fail(fd);
+
+    close(fd);
+
+    bytes_read_ += n_head + n_tail;
+    num_reads_ += (n_tail > 0 ? 2 : 1);
+
+    fingerprint_.reset();
+    fingerprint_.add(buffer_, n_head + n_tail);
+    hash = fingerprint_.finish(file_size);
+
+    return true;
+}
@@ -2,7 +2,117 @@
 #define _MD5SUM_H_
 
 #include <string>
+#include <string.h>
 
-std::string md5sum(const std::string& filename);
+static const unsigned int MD5_DIGEST_SIZE = 16;
+
+struct Md5Digest
+{
+    Md5Digest() { memset(bytes, 0, sizeof(bytes)); }
+
+    unsigned char bytes[MD5_DIGEST_SIZE];
+
+    bool operator==(const Md5Digest& other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+
+    bool operator!=(const Md5Digest& other) const { return !(*this == other); }
+};
+
+// Converts a raw digest to lower case hex
+std::string toHex(const unsigned char* data, unsigned int size);
+
+std::string toHex(const Md5Digest& digest);
+
+// Parses a digest in hex (either case). Returns false if 'hex' is not 32 hex digits.
+bool fromHex(const char* hex, std::size_t size, Md5Digest& digest);
+
+bool fromHex(const std::string& hex, Md5Digest& digest);
+
+static const unsigned long PARTIAL_HASH_BLOCK_SIZE = 64 * 1024;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Computes the partial hash (see FileHasher::partialHash()) from a stream of file data. The data can
+// either be the complete file, or its first and its last PARTIAL_HASH_BLOCK_SIZE bytes.
+
+class FingerprintBuilder
+{
+
+public:
+
+    FingerprintBuilder() : head_size_(0), tail_size_(0) {}
+
+    void reset() { head_size_ = 0; tail_size_ = 0; }
+
+    void add(const unsigned char* data, unsigned long size);
+
+    unsigned long finish(unsigned long file_size);
+
+private:
+
+    unsigned char head_[2 * PARTIAL_HASH_BLOCK_SIZE];
+
+    unsigned long head_size_;
+
+    unsigned char tail_[PARTIAL_HASH_BLOCK_SIZE];
+
+    unsigned long tail_size_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Streams files through a fixed, aligned buffer instead of mapping them as a whole, such that memory use
+// is bounded by the chunk size. Without direct I/O, pages that have been hashed are dropped from the page
+// cache so that large scans do not evict everything else. Not thread-safe: use one hasher per thread.
+
+class FileHasher
+{
+
+public:
+
+    FileHasher(unsigned long chunk_size = 1024 * 1024, bool direct_io = false);
+
+    ~FileHasher();
+
+    FileHasher(const FileHasher&) = delete;
+
+    FileHasher& operator=(const FileHasher&) = delete;
+
+    // Computes the md5sum of the file. Returns false on failure, in which case error() holds the errno of
+    // the failing call. If 'fingerprint' is given, the partial hash is computed from the same reads.
+    bool md5sum(const std::string& filename, Md5Digest& md5sum, unsigned long* fingerprint = 0);
+
+    // Fast 64-bit fingerprint of the file size and its first and last PARTIAL_HASH_BLOCK_SIZE bytes.
+    // Files smaller than two blocks are hashed completely. The result is never zero.
+    bool partialHash(const std::string& filename, unsigned long& hash);
+
+    int error() const { return error_; }
+
+    // Total number of bytes and read calls issued by this hasher
+    unsigned long bytesRead() const { return bytes_read_; }
+
+    unsigned long numReads() const { return num_reads_; }
+
+private:
+
+    unsigned long chunk_size_;
+
+    bool direct_io_;
+
+    unsigned char* buffer_;
+
+    int error_;
+
+    unsigned long bytes_read_;
+
+    unsigned long num_reads_;
+
+    FingerprintBuilder fingerprint_;
+
+    int openFile(const std::string& filename, bool direct_io, unsigned long& file_size);
+
+    bool fail(int fd);
+
+};
 
 #endif
@@ -0,0 +1,29 @@
+#ifndef PHOTO_MANAGER_PARALLEL_FOR_H_
+#define PHOTO_MANAGER_PARALLEL_FOR_H_
+
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <cstddef>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Splits [0, n) into 'num_threads' consecutive ranges of (almost) equal size and calls f(begin, end) for
+// each of them on its own thread, the first one on the calling thread. Returns when all calls are done.
+
+template<typename F>
+void parallelFor(std::size_t n, unsigned int num_threads, const F& f)
+{
+    num_threads = (unsigned int)std::max<std::size_t>(1, std::min<std::size_t>(num_threads, n));
+
+    std::vector<std::thread> threads;
+    for(unsigned int i = 1; i < num_threads; ++i)
+        threads.push_back(std::thread(f, n * i / num_threads, n * (i + 1) / num_threads));
+
+    f(0, n / num_threads);
+
+    for(std::thread& t : threads)
+        t.join();
+}
+
+#endif
@@ -0,0 +1,352 @@
+#include "perceptual_hash.h"
+
+#include "preview_cache.h"
+#include "parallel_for.h"
+
+#include <stdint.h>
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <iostream>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Photos are decoded to fit into this size for hashing, which allows the smallest JPEG scale
+static const int HASH_DECODE_SIZE = 64;
+
+// Parts of the hashes by which photos are bucketed: at least 3, such that a part has at most 22 bits and
+// the buckets of a part fit into memory
+static const unsigned int MIN_HASH_PARTS = 3;
+
+// ----------------------------------------------------------------------------------------------------
+
+uint32_t findRoot(std::vector<uint32_t>& parent, uint32_t i)
+{
+    while(parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+
+    return i;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Adds all values that have at most 'radius' bits set, below bit 'end', to 'key'
+void addNeighbours(unsigned long key, unsigned int end, unsigned int radius, std::vector<unsigned long>& neighbours)
+{
+    neighbours.push_back(key);
+    if (radius == 0)
+        return;
+
+    for(unsigned int i = 0; i < end; ++i)
+        addNeighbours(key | (1ul << i), i, radius - 1, neighbours);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Photos bucketed by one part of their hashes, bits [shift, shift + bits)
+struct HashBuckets
+{
+    unsigned int shift;
+    unsigned int bits;
+
+    // Bucket k is [offsets[k], offsets[k + 1]) of 'hashes' and 'order'
+    std::vector<uint32_t> offsets;
+
+    std::vector<unsigned long> hashes;
+
+    // Positions of the photos in the input of findNearDuplicates()
+    std::vector<uint32_t> order;
+
+    // Keys are compared with those that differ by one of these, i.e., in up to the search radius of bits
+    std::vector<unsigned long> neighbours;
+
+    unsigned long key(unsigned long hash) const { return (hash >> shift) & ((1ul << bits) - 1); }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Compares the hashes at [begin, end) of part 'j' with those in the buckets within 'radius' of them, and
+// adds the pairs within 'max_distance' to 'found'. A pair is taken from its first photo, and from the first
+// part within the radius. The build targets generic x86-64, which has no popcount instruction; this is
+// where nearly all the time goes, so it gets a clone that uses one if the CPU has it.
+#if defined(__x86_64__)
+__attribute__((target_clones("popcnt", "default")))
+#endif
+void findPairs(const HashBuckets& buckets, unsigned int j, const std::vector<unsigned long>& part_masks,
+               unsigned int radius, unsigned int max_distance, std::size_t begin, std::size_t end,
+               std::vector<std::pair<uint32_t, uint32_t> >& found)
+{
+    const uint32_t* offsets = buckets.offsets.data();
+    const unsigned long* hashes = buckets.hashes.data();
+    const uint32_t* order = buckets.order.data();
+
+    for(std::size_t a = begin; a < end; ++a)
+    {
+        unsigned long h = hashes[a];
+        unsigned long h_key = buckets.key(h);
+
+        for(unsigned long neighbour : buckets.neighbours)
+        {
+            unsigned long key = h_key ^ neighbour;
+            for(uint32_t b = offsets[key]; b < offsets[key + 1]; ++b)
+            {
+                if (hammingDistance(h, hashes[b]) > max_distance || order[b] <= order[a])
+                    continue;
+
+                unsigned long diff = h ^ hashes[b];
+                unsigned int i = 0;
+                while(i < j && (unsigned int)__builtin_popcountll(diff & part_masks[i]) > radius)
+                    ++i;
+
+                if (i == j)
+                    found.push_back(std::make_pair(order[a], order[b]));
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// The number of parts to cut hashes into for findNearDuplicates(). Two hashes within 'max_distance' are
+// within max_distance / num_parts of each other in at least one part. More parts mean fewer buckets to
+// look into for each photo, but more photos in each bucket: take the number with the least estimated work,
+// counting a bucket looked into as a few comparisons.
+unsigned int numHashParts(std::size_t n, unsigned int max_distance)
+{
+    unsigned int best = MIN_HASH_PARTS;
+    double best_cost = 0;
+
+    for(unsigned int num_parts = MIN_HASH_PARTS; num_parts <= std::max(max_distance + 1, MIN_HASH_PARTS); ++num_parts)
+    {
+        unsigned int bits = 64 / num_parts;
+        unsigned int radius = max_distance / num_parts;
+
+        double num_buckets = 0, c = 1;
+        for(unsigned int k = 0; k <= radius; ++k)
+        {
+            num_buckets += c;
+            c = c * (bits - k) / (k + 1);
+        }
+
+        double bucket_size = n / std::ldexp(1.0, bits);
+        double cost = num_parts * (double)n * num_buckets * (4 + bucket_size);
+        if (num_parts == MIN_HASH_PARTS || cost < best_cost)
+        {
+            best = num_parts;
+            best_cost = cost;
+        }
+    }
+
+    return best;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long perceptualHash(const cv::Mat& image)
+{
+    cv::Mat gray;
+    if (image.channels() == 1)
+        gray = image;
+    else
+        cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+
+    cv::Mat small;
+    cv::resize(gray, small, cv::Size(9, 8), 0, 0, cv::INTER_AREA);
+
+    unsigned long hash = 0;
+    for(int y = 0; y < 8; ++y)
+    {
+        const unsigned char* row = small.ptr<unsigned char>(y);
+        for(int x = 0; x < 8; ++x)
+            hash = (hash << 1) | (row[x] > row[x + 1]);
+    }
+
+    return hash;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool perceptualHash(const std::string& filename, unsigned long& hash)
+{
+    cv::Mat image = decodeToFit(filename, HASH_DECODE_SIZE, HASH_DECODE_SIZE);
+    if (!image.data)
+        return false;
+
+    hash = perceptualHash(image);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long hashPhotos(PhotoDatabase& db, unsigned int num_threads)
+{
+    const PhotoStore& photos = db.photos();
+
+    std::vector<Id> missing;
+    for(const PhotoData& p : photos)
+    {
+        if (!p.has_perceptual_hash)
+            missing.push_back(p.id());
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Decode on all threads, taking one photo at a time since they differ a lot in size
+
+    std::vector<unsigned long> hashes(missing.size());
+    std::vector<char> hashed(missing.size(), 0);
+    std::atomic<std::size_t> next(0);
+    std::mutex out_mutex;
+
+    num_threads = std::max(1u, num_threads);
+    parallelFor(num_threads, num_threads, [&](std::size_t, std::size_t)
+    {
+        for(std::size_t i = next++; i < missing.size(); i = next++)
+        {
+            std::string photo_filename = db.photoPrefixPath() + db.filename(photos[missing[i]]);
+            if (perceptualHash(photo_filename, hashes[i]))
+            {
+                hashed[i] = 1;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(out_mutex);
+                std::cout << "Cannot hash '" << photo_filename << "'" << std::endl;
+            }
+        }
+    });
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Store the hashes
+
+    unsigned long n_hashed = 0;
+    for(std::size_t i = 0; i < missing.size(); ++i)
+    {
+        if (!hashed[i])
+            continue;
+
+        db.setPhotoPerceptualHash(db.photo(missing[i]), hashes[i]);
+        ++n_hashed;
+    }
+
+    return n_hashed;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void findNearDuplicates(const std::vector<std::pair<unsigned long, Id> >& photos, unsigned int max_distance,
+                        unsigned int num_threads, std::vector<std::vector<Id> >& groups)
+{
+    groups.clear();
+
+    std::size_t n = photos.size();
+    max_distance = std::min(max_distance, 63u);
+
+    unsigned int num_parts = numHashParts(n, max_distance);
+    unsigned int radius = max_distance / num_parts;
+
+    std::vector<unsigned long> part_masks(num_parts);
+    for(unsigned int j = 0; j < num_parts; ++j)
+    {
+        unsigned int begin = 64 * j / num_parts, end = 64 * (j + 1) / num_parts;
+        part_masks[j] = ((1ul << (end - begin)) - 1) << begin;
+    }
+
+    // Groups as a union-find forest over the positions in 'photos'
+    std::vector<uint32_t> parent(n);
+    for(std::size_t i = 0; i < n; ++i)
+        parent[i] = i;
+
+    HashBuckets buckets;
+    buckets.hashes.resize(n);
+    buckets.order.resize(n);
+
+    for(unsigned int j = 0; j < num_parts; ++j)
+    {
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Bucket the hashes by part j with a counting sort
+
+        buckets.shift = 64 * j / num_parts;
+        buckets.bits = 64 * (j + 1) / num_parts - buckets.shift;
+
+        std::vector<uint32_t>& offsets = buckets.offsets;
+        offsets.assign((1ul << buckets.bits) + 1, 0);
+        for(std::size_t i = 0; i < n; ++i)
+            ++offsets[buckets.key(photos[i].first) + 1];
+        for(std::size_t k = 1; k < offsets.size(); ++k)
+            offsets[k] += offsets[k - 1];
+
+        buckets.neighbours.clear();
+        addNeighbours(0, buckets.bits, radius, buckets.neighbours);
+
+        std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+        for(std::size_t i = 0; i < n; ++i)
+        {
+            uint32_t pos = fill[buckets.key(photos[i].first)]++;
+            buckets.order[pos] = i;
+            buckets.hashes[pos] = photos[i].first;
+        }
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Find the pairs
+
+        std::vector<std::pair<uint32_t, uint32_t> > pairs;
+        std::mutex pairs_mutex;
+
+        parallelFor(n, num_threads, [&](std::size_t begin, std::size_t end)
+        {
+            std::vector<std::pair<uint32_t, uint32_t> > found;
+            findPairs(buckets, j, part_masks, radius, max_distance, begin, end, found);
+
+            std::lock_guard<std::mutex> lock(pairs_mutex);
+            pairs.insert(pairs.end(), found.begin(), found.end());
+        });
+
+        for(const std::pair<uint32_t, uint32_t>& pair : pairs)
+        {
+            uint32_t root_a = findRoot(parent, pair.first);
+            uint32_t root_b = findRoot(parent, pair.second);
+            if (root_a != root_b)
+                parent[std::max(root_a, root_b)] = std::min(root_a, root_b);
+        }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Collect the groups of more than one photo
+
+    std::vector<uint32_t> group_size(n, 0);
+    for(std::size_t i = 0; i < n; ++i)
+        ++group_size[findRoot(parent, i)];
+
+    std::vector<uint32_t> group_of(n, (uint32_t)-1);
+    for(std::size_t i = 0; i < n; ++i)
+    {
+        uint32_t root = findRoot(parent, i);
+        if (group_size[root] < 2)
+            continue;
+
+        if (group_of[root] == (uint32_t)-1)
+        {
+            group_of[root] = groups.size();
+            groups.push_back(std::vector<Id>());
+        }
+
+        groups[group_of[root]].push_back(photos[i].second);
+    }
+
+    for(std::vector<Id>& group : groups)
+        std::sort(group.begin(), group.end());
+
+    std::sort(groups.begin(), groups.end());
+}
@@ -0,0 +1,42 @@
+#ifndef PHOTO_MANAGER_PERCEPTUAL_HASH_H_
+#define PHOTO_MANAGER_PERCEPTUAL_HASH_H_
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include <opencv2/core/core.hpp>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// 64-bit difference hash (dHash) of an image: it is shrunk to 9 x 8 gray pixels, and each bit tells whether
+// a pixel is brighter than its right neighbour. Resizing, re-encoding and small edits change few bits.
+unsigned long perceptualHash(const cv::Mat& image);
+
+// Decodes a photo at reduced size and hashes it. Returns false if the photo cannot be read.
+bool perceptualHash(const std::string& filename, unsigned long& hash);
+
+inline unsigned int hammingDistance(unsigned long a, unsigned long b)
+{
+    return __builtin_popcountll(a ^ b);
+}
+
+// Hashes the photos that have no valid hash yet on 'num_threads' threads. Returns the number of photos
+// hashed; those that cannot be read are left without a hash.
+unsigned long hashPhotos(PhotoDatabase& db, unsigned int num_threads);
+
+// ----------------------------------------------------------------------------------------------------
+
+// Groups of photos whose hashes differ in at most 'max_distance' bits, directly or through other photos
+// of the group, each sorted by id. 'photos' are pairs of hash and id.
+//
+// Uses multi-index hashing: the hashes are cut into m parts, and two hashes within the distance are within
+// max_distance / m bits of each other in at least one part. Photos are bucketed by each part in turn, and
+// each is only compared with those in the buckets within that radius of its own, which takes seconds for a
+// million photos up to a distance of about 8.
+void findNearDuplicates(const std::vector<std::pair<unsigned long, Id> >& photos, unsigned int max_distance,
+                        unsigned int num_threads, std::vector<std::vector<Id> >& groups);
+
+#endif
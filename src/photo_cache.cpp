@@ -0,0 +1,174 @@
+#include "photo_cache.h"
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+std::size_t photoBytes(const cv::Mat& photo)
+{
+    return photo.total() * photo.elemSize();
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+PhotoCache::PhotoCache(const std::function<cv::Mat(const PhotoSource&)>& load, std::size_t max_bytes,
+                       unsigned int num_threads) : load_(load), max_bytes_(max_bytes), stop_(false), bytes_(0)
+{
+    for(unsigned int i = 0; i < std::max(1u, num_threads); ++i)
+        workers_.push_back(std::thread(&PhotoCache::worker, this));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PhotoCache::~PhotoCache()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+
+    for(std::thread& t : workers_)
+        t.join();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat PhotoCache::get(const PhotoSource& source)
+{
+    Id id = source.id;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this, id]() { return loading_.find(id) == loading_.end(); });
+
+    auto it = entries_.find(id);
+    if (it != entries_.end())
+    {
+        touch(it->second);
+        return it->second.photo;
+    }
+
+    // Not prefetched: decode it here rather than wait for a worker to get to it
+    loading_.insert(id);
+    lock.unlock();
+
+    cv::Mat photo = load_(source);
+
+    lock.lock();
+    loading_.erase(id);
+    insert(id, photo);
+    changed_.notify_all();
+
+    return photo;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PhotoCache::tryGet(Id id, cv::Mat& photo)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = entries_.find(id);
+    if (it == entries_.end())
+        return false;
+
+    touch(it->second);
+    photo = it->second.photo;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoCache::prefetch(const std::vector<PhotoSource>& photos)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Cached photos that are still wanted are evicted last, the most urgent ones after the others
+    for(auto p = photos.rbegin(); p != photos.rend(); ++p)
+    {
+        auto it = entries_.find(p->id);
+        if (it != entries_.end())
+            touch(it->second);
+    }
+
+    queue_.clear();
+    for(const PhotoSource& p : photos)
+    {
+        if (entries_.find(p.id) == entries_.end() && loading_.find(p.id) == loading_.end())
+            queue_.push_back(p);
+    }
+
+    changed_.notify_all();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::size_t PhotoCache::memoryUsage() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoCache::worker()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    while(true)
+    {
+        changed_.wait(lock, [this]() { return stop_ || !queue_.empty(); });
+        if (stop_)
+            return;
+
+        PhotoSource source = queue_.front();
+        queue_.erase(queue_.begin());
+
+        // get() may have decoded it meanwhile
+        Id id = source.id;
+        if (entries_.find(id) != entries_.end() || loading_.find(id) != loading_.end())
+            continue;
+
+        loading_.insert(id);
+        lock.unlock();
+
+        cv::Mat photo = load_(source);
+
+        lock.lock();
+        loading_.erase(id);
+        insert(id, photo);
+        changed_.notify_all();
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoCache::insert(Id id, const cv::Mat& photo)
+{
+    lru_.push_front(id);
+
+    Entry& entry = entries_[id];
+    entry.photo = photo;
+    entry.lru_pos = lru_.begin();
+    bytes_ += photoBytes(photo);
+
+    // The newest photo stays even if it alone is over the limit
+    while(bytes_ > max_bytes_ && lru_.size() > 1)
+    {
+        auto it = entries_.find(lru_.back());
+        bytes_ -= photoBytes(it->second.photo);
+        entries_.erase(it);
+        lru_.pop_back();
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoCache::touch(Entry& entry)
+{
+    lru_.splice(lru_.begin(), lru_, entry.lru_pos);
+}
@@ -0,0 +1,100 @@
+#ifndef PHOTO_MANAGER_PHOTO_CACHE_H_
+#define PHOTO_MANAGER_PHOTO_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <list>
+#include <set>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+
+#include <opencv2/core/core.hpp>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// What a worker needs to know of a photo to decode it, taken from the database beforehand
+struct PhotoSource
+{
+    Id id;
+    Md5Digest md5sum;
+    std::string filename;   // Including the photo prefix path
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Decoded photos by id, at most 'max_bytes' of pixels, evicted in least recently used order. Worker threads
+// decode the photos given to prefetch() ahead of time, such that get() usually returns at once.
+
+class PhotoCache
+{
+
+public:
+
+    // 'load' decodes a photo (an empty Mat if it cannot), on any thread
+    PhotoCache(const std::function<cv::Mat(const PhotoSource&)>& load, std::size_t max_bytes,
+               unsigned int num_threads);
+
+    ~PhotoCache();
+
+    // Returns the photo, waiting for its decode if a worker is at it, and otherwise decoding it right away
+    cv::Mat get(const PhotoSource& photo);
+
+    // Sets 'photo' and returns true if the photo is cached, without waiting
+    bool tryGet(Id id, cv::Mat& photo);
+
+    // Replaces the photos to decode ahead, most urgent first. Decodes of photos no longer in the list that
+    // have not started yet are dropped, those in progress are finished and cached.
+    void prefetch(const std::vector<PhotoSource>& photos);
+
+    std::size_t memoryUsage() const;
+
+private:
+
+    std::function<cv::Mat(const PhotoSource&)> load_;
+
+    std::size_t max_bytes_;
+
+    std::vector<std::thread> workers_;
+
+    mutable std::mutex mutex_;
+
+    // Signaled when a decode is queued, and when one is done
+    std::condition_variable changed_;
+
+    bool stop_;
+
+    // Photos to decode, most urgent first
+    std::vector<PhotoSource> queue_;
+
+    // Photos being decoded by a worker
+    std::set<Id> loading_;
+
+    struct Entry
+    {
+        cv::Mat photo;
+        std::list<Id>::iterator lru_pos;
+    };
+
+    std::map<Id, Entry> entries_;
+
+    // Most recently used first
+    std::list<Id> lru_;
+
+    std::size_t bytes_;
+
+    void worker();
+
+    // Adds a decoded photo and evicts the least recently used ones beyond the limit. Needs the lock.
+    void insert(Id id, const cv::Mat& photo);
+
+    // Marks a cached photo as most recently used. Needs the lock.
+    void touch(Entry& entry);
+
+};
+
+#endif
@@ -1,7 +1,17 @@
 #include "photo_database.h"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
 #include <iostream>
 #include <set>
+#include <thread>
+#include <iterator>
 
 // File operations
 #include <fstream>
@@ -9,6 +19,9 @@
 // MD5sum
 #include "md5sum.h"
 
+#include "parallel_for.h"
+#include "binary_database.h"
+
 // ----------------------------------------------------------------------------------------------------
 
 std::string idToStr(Id id)
@@ -31,11 +44,11 @@ std::string idToStr(Id id)
 
 // ----------------------------------------------------------------------------------------------------
 
-Id strToId(const std::string& s)
+Id strToId(const char* s, std::size_t size)
 {
     unsigned long id = 0;
     unsigned long f = 1;
-    for(unsigned int i = 0; i < s.size(); ++i)
+    for(std::size_t i = 0; i < size; ++i)
     {
         char c = s[i];
         if (c <= '9')
@@ -50,6 +63,13 @@ Id strToId(const std::string& s)
 
 // ----------------------------------------------------------------------------------------------------
 
+Id strToId(const std::string& s)
+{
+    return strToId(s.data(), s.size());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 time_t strToTime(const std::string& s)
 {
     struct tm t;
@@ -69,88 +89,780 @@ std::string timeToStr(time_t rawtime)
 
 // ----------------------------------------------------------------------------------------------------
 
-std::string nextWord(const std::string& s, std::size_t& idx)
+// Returns the next word of the line [pos, end) and advances 'pos' past it. Words are separated by single
+// spaces, and double quotes group spaces into a word. Words are returned in place if possible, and only
+// unquoted into 'scratch' if they have quotes anywhere but around the whole word.
+StringRef nextWord(const char*& pos, const char* end, std::string& scratch)
 {
-    std::string w;
-    bool quotes = 0;
-    for(; idx < s.size(); ++idx)
+    const char* start = pos;
+
+    if (pos < end && *pos == '"')
     {
-        char c = s[idx];
+        const char* close = (const char*)memchr(pos + 1, '"', end - pos - 1);
+        if (close && (close + 1 == end || close[1] == ' '))
+        {
+            pos = (close + 1 == end ? end : close + 2);
+            return StringRef(start + 1, close - start - 1);
+        }
+    }
+    else
+    {
+        const char* space = (const char*)memchr(pos, ' ', end - pos);
+        const char* word_end = (space ? space : end);
+        if (!memchr(pos, '"', word_end - pos))
+        {
+            pos = (space ? space + 1 : end);
+            return StringRef(start, word_end - start);
+        }
+    }
+
+    scratch.clear();
+    bool quotes = false;
+    for(; pos < end; ++pos)
+    {
+        char c = *pos;
         if (c == '"')
         {
             quotes = !quotes;
         }
-        else if (!quotes && (c == ' ' || c == '\n'))
+        else if (!quotes && c == ' ')
         {
-            ++idx;
-            return w;
+            ++pos;
+            break;
         }
         else
         {
-            w += c;
+            scratch += c;
         }
     }
-    return w;
+
+    return StringRef(scratch.data(), scratch.size());
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-bool loadDatabase(const std::string filename, PhotoDatabase& db)
+bool equals(const StringRef& s, const char* literal)
 {
-    std::ifstream fin(filename.c_str());
+    return s.size == strlen(literal) && memcmp(s.data, literal, s.size) == 0;
+}
 
-    std::string line;
+// ----------------------------------------------------------------------------------------------------
 
-    // Load concepts
-    while(std::getline(fin, line))
+void PhotoDatabase::appendPhotos(PhotoBatch& batch)
+{
+    // The first batch of an empty database is taken over with its filenames, and nothing to remap. This
+    // also keeps the arena of a loaded binary database as it was saved.
+    if (filenames_->empty())
     {
-        if (line == "")
-            break;
+        std::swap(filenames_.write(), batch.filenames);
+    }
+    else
+    {
+        std::vector<uint32_t> dir_map;
+        uint32_t name_offset = filenames_.write().append(batch.filenames, dir_map);
 
-        std::size_t idx = 0;
-        std::string id_str = nextWord(line, idx);
-        std::string concept = nextWord(line, idx);
-        std::transform(concept.begin(), concept.end(), concept.begin(), ::tolower);
+        for(Id i = 0; i < batch.photos.size(); ++i)
+        {
+            PhotoData& p = batch.photos.write(i);
+            p.filename.dir = dir_map[p.filename.dir];
+            p.filename.name += name_offset;
+        }
+    }
+
+    photos_.append(batch.photos);
 
-        db.addConcept(concept, strToId(id_str));
+    if (batch.tag_to_photos.size() > tag_to_photos_.size())
+        tag_to_photos_.resize(batch.tag_to_photos.size());
+
+    for(std::size_t tag = 0; tag < batch.tag_to_photos.size(); ++tag)
+    {
+        Bitmap& photos = tag_to_photos_[tag].write();
+        if (photos.empty())
+            std::swap(photos, batch.tag_to_photos[tag]);
+        else
+            photos |= batch.tag_to_photos[tag];
     }
 
-    // Load photo data
-    while(std::getline(fin, line))
+    if (!batch.tag_to_photos.empty())
+        concept_index_built_ = false;
+    todo_index_built_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::rebuildIndexes(unsigned int num_threads)
+{
+    md5sum_to_photo_.build(photos_.size(), Md5sumOf(photos_), num_threads);
+    filename_to_photo_.build(photos_.size(), FilenameOf(photos_, *filenames_), num_threads);
+
+    inode_to_photo_.clear();
+    size_to_photos_.clear();
+    stat_indexes_built_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PhotoDatabase::restoreIndexes(const HashSlot* md5sum_slots, std::size_t n_md5sum_slots,
+                                   const HashSlot* filename_slots, std::size_t n_filename_slots)
+{
+    inode_to_photo_.clear();
+    size_to_photos_.clear();
+    stat_indexes_built_ = false;
+
+    if (md5sum_to_photo_.assign(md5sum_slots, n_md5sum_slots, photos_.size()) &&
+        filename_to_photo_.assign(filename_slots, n_filename_slots, photos_.size()))
+        return true;
+
+    md5sum_to_photo_.clear();
+    filename_to_photo_.clear();
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Fills the ordered maps from sorted runs, which is much faster than inserting the photos one by one
+void PhotoDatabase::buildStatIndexes()
+{
+    std::vector<std::pair<std::pair<unsigned long, unsigned long>, Id> > inodes;
+    std::vector<std::pair<unsigned long, Id> > sizes;
+    for(const PhotoData& p : photos_)
     {
-        std::size_t idx = 0;
+        if (p.stat.valid())
+        {
+            inodes.push_back(std::make_pair(std::make_pair(p.stat.device, p.stat.inode), p.id()));
+            sizes.push_back(std::make_pair(p.stat.size, p.id()));
+        }
+    }
 
-        PhotoData* p = db.addPhoto();
+    std::sort(inodes.begin(), inodes.end());
+    std::sort(sizes.begin(), sizes.end());
+
+    // Later photos win on equal inodes, as with registerPhoto()
+    inode_to_photo_.clear();
+    for(std::size_t i = 0; i < inodes.size(); ++i)
+    {
+        if (i + 1 == inodes.size() || inodes[i + 1].first != inodes[i].first)
+            inode_to_photo_.emplace_hint(inode_to_photo_.end(), inodes[i]);
+    }
+
+    size_to_photos_.clear();
+    for(std::size_t i = 0; i < sizes.size(); ++i)
+    {
+        if (i == 0 || sizes[i].first != sizes[i - 1].first)
+            size_to_photos_.emplace_hint(size_to_photos_.end(), sizes[i].first, std::vector<Id>());
+        size_to_photos_.rbegin()->second.push_back(sizes[i].second);
+    }
+
+    stat_indexes_built_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::buildConceptIndex()
+{
+    std::vector<unsigned long> usage(concepts_->names.size(), 0);
+    for(Id tag = 0; tag < usage.size(); ++tag)
+        usage[tag] = photosWithTag(tag).cardinality();
+
+    concept_index_.build(concepts_->names, usage);
+    concept_index_built_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::buildTodoIndex()
+{
+    todo_ = Bitmap();
+    for(const PhotoData& p : photos_)
+    {
+        if (p.tags().empty() && !p.isDone())
+            todo_.add(p.id());
+    }
+
+    todo_index_built_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string statToStr(const FileStat& stat, unsigned long fingerprint)
+{
+    return idToStr(stat.size) + " " + idToStr(stat.mtime) + " " + idToStr(stat.device) + " " + idToStr(stat.inode) +
+           " " + idToStr(fingerprint);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordConcept(Id id)
+{
+    changes_ += "concept " + idToStr(id) + " \"" + getConcept(id) + "\"\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordPhoto(const PhotoData& p)
+{
+    changes_ += "photo " + idToStr(p.id()) + " " + toHex(p.md5sum) + " \"" + filename(p) + "\" " +
+                statToStr(p.stat, p.fingerprint) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordFilename(const PhotoData& p)
+{
+    changes_ += "move " + idToStr(p.id()) + " \"" + filename(p) + "\"\n";
+}
 
-        p->md5sum = nextWord(line, idx);
-        p->rel_filename = nextWord(line, idx);
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordMd5sum(const PhotoData& p)
+{
+    changes_ += "md5sum " + idToStr(p.id()) + " " + toHex(p.md5sum) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordStat(const PhotoData& p, const FileStat& stat)
+{
+    changes_ += "stat " + idToStr(p.id()) + " " + statToStr(stat, p.fingerprint) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordPerceptualHash(const PhotoData& p)
+{
+    changes_ += "phash " + idToStr(p.id()) + " " + idToStr(p.perceptual_hash) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordDuplicate(const std::string& rel_filename, const KnownDuplicate& d)
+{
+    changes_ += "duplicate " + idToStr(d.photo) + " " + toHex(d.md5sum) + " \"" + rel_filename + "\" " +
+                statToStr(d.stat, 0) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordRemoveDuplicate(const std::string& rel_filename, const KnownDuplicate& d)
+{
+    changes_ += "unduplicate " + idToStr(d.photo) + " \"" + rel_filename + "\"\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordTag(const PhotoData& p, Id tag)
+{
+    changes_ += "tag " + idToStr(p.id()) + " " + idToStr(tag) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PhotoDatabase::recordDone(const PhotoData& p)
+{
+    changes_ += "done " + idToStr(p.id()) + "\n";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Lines [begin, end) of the photo section of a database file, parsed into photos with ids from 'first_id'
+struct LoadChunk
+{
+    const char* begin;
+    const char* end;
+
+    std::size_t n_lines;
+    Id first_id;
+
+    PhotoBatch batch;
+
+    std::vector<std::string> invalid_md5sums;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+std::size_t countLines(const char* begin, const char* end)
+{
+    std::size_t n = 0;
+    for(const char* p = begin; (p = (const char*)memchr(p, '\n', end - p)) != 0; ++p)
+        ++n;
 
-        std::string opt;
+    // The last line may lack its newline
+    if (begin < end && end[-1] != '\n')
+        ++n;
+
+    return n;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void loadPhotos(LoadChunk& chunk)
+{
+    PhotoBatch& batch = chunk.batch;
+
+    const char* pos = chunk.begin;
+    std::string scratch;
+
+    enum { OPT_NONE, OPT_TAGS, OPT_STAT, OPT_FP, OPT_PH } opt;
+
+    while(pos < chunk.end)
+    {
+        const char* eol = (const char*)memchr(pos, '\n', chunk.end - pos);
+        if (!eol)
+            eol = chunk.end;
+
+        const char* line = pos;
+        pos = (eol == chunk.end ? chunk.end : eol + 1);
+
+        PhotoData* p = &batch.photos.push_back(PhotoData(chunk.first_id + batch.photos.size()));
+
+        StringRef md5sum = nextWord(line, eol, scratch);
+        if (!fromHex(md5sum.data, md5sum.size, p->md5sum))
+            chunk.invalid_md5sums.push_back(std::string(md5sum.data, md5sum.size));
+
+        StringRef rel_filename = nextWord(line, eol, scratch);
+        p->filename = batch.filenames.add(rel_filename.data, rel_filename.size);
+
+        opt = OPT_NONE;
+        unsigned int i_opt_arg = 0;
 
         while(true)
         {
-            std::string word = nextWord(line, idx);
-            if (word.empty())
+            StringRef word = nextWord(line, eol, scratch);
+            if (word.size == 0)
                 break;
 
-            if (word[0] == '-')
+            if (word.data[0] == '-')
             {
-                opt = word.substr(1);
+                if (equals(word, "-tags"))
+                    opt = OPT_TAGS;
+                else if (equals(word, "-stat"))
+                    opt = OPT_STAT;
+                else if (equals(word, "-fp"))
+                    opt = OPT_FP;
+                else if (equals(word, "-ph"))
+                    opt = OPT_PH;
+                else
+                    opt = OPT_NONE;
 
-                if (opt == "done")
+                i_opt_arg = 0;
+
+                if (equals(word, "-done"))
                     p->setDone();
 
                 continue;
             }
 
-            if (opt == "tags")
+            Id v = strToId(word.data, word.size);
+
+            switch(opt)
             {
-                Id tag_id = strToId(word);
-                p->addTag(tag_id);
+            case OPT_TAGS:
+                batch.addPhotoTag(p, v);
+                break;
+            case OPT_FP:
+                p->fingerprint = v;
+                break;
+            case OPT_PH:
+                p->perceptual_hash = v;
+                p->has_perceptual_hash = true;
+                break;
+            case OPT_STAT:
+                switch(i_opt_arg)
+                {
+                case 0: p->stat.size = v; break;
+                case 1: p->stat.mtime = v; break;
+                case 2: p->stat.device = v; break;
+                case 3: p->stat.inode = v; break;
+                }
+                break;
+            case OPT_NONE:
+                break;
             }
+
+            ++i_opt_arg;
         }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Reads 'n' ids into 'ids'. Returns false if the line ends before.
+bool nextIds(const char*& pos, const char* end, std::string& scratch, unsigned long* ids, unsigned int n)
+{
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        StringRef word = nextWord(pos, end, scratch);
+        if (word.size == 0)
+            return false;
+
+        ids[i] = strToId(word.data, word.size);
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Text database format: one line per concept ('<id> "<name>"'), an empty line, and then one line per photo:
+// '<md5sum> "<filename>" [-tags <id>...] [-done] [-stat <size> <mtime> <device> <inode>] [-fp <fingerprint>]
+// [-ph <perceptual hash>]'. Known duplicates may follow after another empty line, one per line:
+// '<photo id> <md5sum> "<filename>" <size> <mtime> <device> <inode>'
+bool loadTextDatabase(const char* data, std::size_t size, const std::string& filename, PhotoDatabase& db)
+{
+    const char* end = data + size;
+    const char* pos = data;
+    std::string scratch;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Load concepts
+
+    while(pos < end)
+    {
+        const char* eol = (const char*)memchr(pos, '\n', end - pos);
+        if (!eol)
+            eol = end;
+
+        const char* line = pos;
+        pos = (eol == end ? end : eol + 1);
+
+        if (line == eol)
+            break;
+
+        StringRef id_str = nextWord(line, eol, scratch);
+        Id id = strToId(id_str.data, id_str.size);
 
+        StringRef word = nextWord(line, eol, scratch);
+        std::string concept(word.data, word.size);
+        std::transform(concept.begin(), concept.end(), concept.begin(), ::tolower);
+
+        db.addConcept(concept, id);
+    }
+
+    // The photos end at the next empty line, if any
+    const char* file_end = end;
+    if (pos < end && *pos == '\n')
+    {
+        end = pos;
+    }
+    else if (pos < end)
+    {
+        const char* blank = (const char*)memmem(pos, end - pos, "\n\n", 2);
+        if (blank)
+            end = blank + 1;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Load photo data: the photo lines are cut into one chunk per thread (of at least 1 MB each), and the
+    // chunks are parsed concurrently and appended in order
+
+    unsigned int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::size_t n_chunks = std::max<std::size_t>(1, std::min<std::size_t>(num_threads, (end - pos) >> 20));
+
+    std::vector<LoadChunk> chunks(n_chunks);
+    for(std::size_t i = 0; i < n_chunks; ++i)
+    {
+        LoadChunk& chunk = chunks[i];
+        chunk.begin = (i == 0 ? pos : chunks[i - 1].end);
+        chunk.end = end;
+
+        // Cut after the first newline past the even split
+        const char* split = std::max(chunk.begin, pos + (end - pos) * (i + 1) / n_chunks);
+        const char* eol = (const char*)memchr(split, '\n', end - split);
+        if (i + 1 < n_chunks && eol)
+            chunk.end = eol + 1;
+    }
+
+    parallelFor(n_chunks, n_chunks, [&](std::size_t first, std::size_t last)
+    {
+        for(std::size_t i = first; i < last; ++i)
+            chunks[i].n_lines = countLines(chunks[i].begin, chunks[i].end);
+    });
+
+    // Move the cuts such that all chunks but the first start on a chunk of the photo store, which lets
+    // appendPhotos() take over the parsed photos as they are
+    Id next_id = db.photos().size();
+    for(std::size_t i = 0; i < n_chunks; ++i)
+    {
+        LoadChunk& chunk = chunks[i];
+        while(i > 0 && next_id % PhotoStore::CHUNK_SIZE != 0 && chunk.n_lines > 0)
+        {
+            const char* eol = (const char*)memchr(chunk.begin, '\n', chunk.end - chunk.begin);
+            chunk.begin = (eol ? eol + 1 : chunk.end);
+            chunks[i - 1].end = chunk.begin;
+            ++chunks[i - 1].n_lines;
+            --chunk.n_lines;
+            ++next_id;
+        }
+
+        chunk.first_id = next_id;
+        next_id += chunk.n_lines;
+    }
+
+    parallelFor(n_chunks, n_chunks, [&](std::size_t first, std::size_t last)
+    {
+        for(std::size_t i = first; i < last; ++i)
+            loadPhotos(chunks[i]);
+    });
+
+    for(LoadChunk& chunk : chunks)
+    {
+        for(const std::string& md5sum : chunk.invalid_md5sums)
+            std::cout << "Invalid md5sum '" << md5sum << "' in " << filename << std::endl;
+
+        db.appendPhotos(chunk.batch);
+        chunk.batch = PhotoBatch();
+    }
+
+    db.rebuildIndexes(num_threads);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Load known duplicates
+
+    for(pos = std::min(end + 1, file_end); pos < file_end; )
+    {
+        const char* eol = (const char*)memchr(pos, '\n', file_end - pos);
+        if (!eol)
+            eol = file_end;
+
+        const char* line = pos;
+        pos = (eol == file_end ? file_end : eol + 1);
+
+        KnownDuplicate d;
+        unsigned long v[4];
+        if (!nextIds(line, eol, scratch, &d.photo, 1))
+            continue;
+
+        StringRef word = nextWord(line, eol, scratch);
+        StringRef rel_filename = nextWord(line, eol, scratch);
+        if (!fromHex(word.data, word.size, d.md5sum) || !nextIds(line, eol, scratch, v, 4) ||
+            d.photo >= db.photos().size())
+        {
+            std::cout << "Invalid duplicate '" << std::string(rel_filename.data, rel_filename.size) << "' in "
+                      << filename << std::endl;
+            continue;
+        }
+
+        d.stat.size = v[0];
+        d.stat.mtime = v[1];
+        d.stat.device = v[2];
+        d.stat.inode = v[3];
+        db.setDuplicate(std::string(rel_filename.data, rel_filename.size), d);
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool loadDatabaseFile(const std::string& filename, PhotoDatabase& db)
+{
+    // A missing database is an empty one
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return true;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    std::size_t size = st.st_size;
+    const char* data = (const char*)mmap(0, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED)
+    {
+        std::cout << "Could not read " << filename << ": " << strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool ok;
+    if (isBinaryDatabase(data, size))
+        ok = loadBinaryDatabase(data, size, filename, db);
+    else
+        ok = loadTextDatabase(data, size, filename, db);
+
+    munmap((void*)data, size);
+
+    return ok;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Applies one journal entry (see PhotoDatabase::recordConcept() etc.). Returns false if it is invalid.
+bool replayEntry(const char* pos, const char* end, PhotoDatabase& db, std::string& scratch)
+{
+    StringRef word = nextWord(pos, end, scratch);
+    std::string op(word.data, word.size);
+
+    Id id;
+    if (!nextIds(pos, end, scratch, &id, 1))
+        return false;
+
+    if (op == "concept")
+    {
+        word = nextWord(pos, end, scratch);
+        db.addConcept(std::string(word.data, word.size), id);
+        return true;
+    }
+
+    if (op == "photo")
+    {
+        // Photos that are already in the database file were added before the journal was last folded
+        // into it (see compactDatabase())
+        if (id < db.photos().size())
+            return true;
+        if (id > db.photos().size())
+            return false;
+
+        Md5Digest md5sum;
+        word = nextWord(pos, end, scratch);
+        if (!fromHex(word.data, word.size, md5sum))
+            return false;
+
+        word = nextWord(pos, end, scratch);
+        std::string rel_filename(word.data, word.size);
+
+        unsigned long v[5];
+        if (!nextIds(pos, end, scratch, v, 5))
+            return false;
+
+        PhotoData* p = db.addPhoto();
+        p->md5sum = md5sum;
+        p->filename = db.addFilename(rel_filename);
+        p->stat.size = v[0];
+        p->stat.mtime = v[1];
+        p->stat.device = v[2];
+        p->stat.inode = v[3];
+        p->fingerprint = v[4];
         db.registerPhoto(p);
+        return true;
+    }
+
+    if (id >= db.photos().size())
+        return false;
+
+    PhotoData* p = db.photo(id);
+
+    if (op == "move")
+    {
+        word = nextWord(pos, end, scratch);
+        db.setPhotoFilename(p, std::string(word.data, word.size));
+    }
+    else if (op == "md5sum")
+    {
+        Md5Digest md5sum;
+        word = nextWord(pos, end, scratch);
+        if (!fromHex(word.data, word.size, md5sum))
+            return false;
+
+        db.setPhotoMd5sum(p, md5sum);
+    }
+    else if (op == "stat")
+    {
+        unsigned long v[5];
+        if (!nextIds(pos, end, scratch, v, 5))
+            return false;
+
+        FileStat stat;
+        stat.size = v[0];
+        stat.mtime = v[1];
+        stat.device = v[2];
+        stat.inode = v[3];
+        p->fingerprint = v[4];
+        db.setPhotoStat(p, stat);
+    }
+    else if (op == "phash")
+    {
+        unsigned long hash;
+        if (!nextIds(pos, end, scratch, &hash, 1))
+            return false;
+
+        db.setPhotoPerceptualHash(p, hash);
+    }
+    else if (op == "duplicate")
+    {
+        KnownDuplicate d;
+        d.photo = id;
+
+        word = nextWord(pos, end, scratch);
+        if (!fromHex(word.data, word.size, d.md5sum))
+            return false;
+
+        word = nextWord(pos, end, scratch);
+        std::string rel_filename(word.data, word.size);
+
+        unsigned long v[5];
+        if (!nextIds(pos, end, scratch, v, 5))
+            return false;
+
+        d.stat.size = v[0];
+        d.stat.mtime = v[1];
+        d.stat.device = v[2];
+        d.stat.inode = v[3];
+        db.setDuplicate(rel_filename, d);
+    }
+    else if (op == "unduplicate")
+    {
+        word = nextWord(pos, end, scratch);
+        db.removeDuplicate(std::string(word.data, word.size));
+    }
+    else if (op == "tag")
+    {
+        Id tag;
+        if (!nextIds(pos, end, scratch, &tag, 1) || tag >= db.concepts().size())
+            return false;
+
+        db.addPhotoTag(p, tag);
+    }
+    else if (op == "done")
+    {
+        db.setPhotoDone(p);
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// A last entry without its newline was cut short (e.g., by a crash). It is ignored and cut off, such that
+// the next entries do not get appended to it.
+bool replayJournal(const std::string& filename, PhotoDatabase& db)
+{
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    if (!fin)
+        return true;
+
+    std::string journal((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+
+    const char* pos = journal.data();
+    const char* end = pos + journal.size();
+    std::string scratch;
+
+    for(unsigned long line_no = 1; pos < end; ++line_no)
+    {
+        const char* eol = (const char*)memchr(pos, '\n', end - pos);
+        if (!eol)
+        {
+            fin.close();
+            if (truncate(filename.c_str(), pos - journal.data()) < 0)
+                std::cout << "Could not repair " << filename << ": " << strerror(errno) << std::endl;
+            break;
+        }
+
+        if (!replayEntry(pos, eol, db, scratch))
+        {
+            std::cout << "Invalid entry on line " << line_no << " of " << filename << std::endl;
+            return false;
+        }
+
+        pos = eol + 1;
     }
 
     return true;
@@ -158,7 +870,26 @@ bool loadDatabase(const std::string filename, PhotoDatabase& db)
 
 // ----------------------------------------------------------------------------------------------------
 
-void writeDatabase(const PhotoDatabase& db, const std::string& filename)
+bool loadDatabase(const std::string filename, PhotoDatabase& db)
+{
+    return loadDatabaseFile(filename, db) && replayJournal(journalFilename(filename), db);
+}
+// ----------------------------------------------------------------------------------------------------
+
+DatabaseFormat databaseFormat(const std::string& filename)
+{
+    char magic[sizeof(BINARY_DATABASE_MAGIC)];
+
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+    if (fin.read(magic, sizeof(magic)) && isBinaryDatabase(magic, sizeof(magic)))
+        return DATABASE_BINARY;
+
+    return DATABASE_TEXT;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool writeTextDatabase(const PhotoDatabase& db, const std::string& filename)
 {
     std::ofstream fout(filename.c_str());
 
@@ -169,15 +900,15 @@ void writeDatabase(const PhotoDatabase& db, const std::string& filename)
         if (concept.empty())
             continue;
 
-        fout << idToStr(i) << " \"" << concept << "\"" << std::endl;
+        fout << idToStr(i) << " \"" << concept << "\"\n";
     }
 
-    fout << std::endl;
+    fout << '\n';
 
     for(unsigned int i = 0; i < db.photos().size(); ++i)
     {
         const PhotoData& p = db.photos()[i];
-        fout << p.md5sum << " \"" << p.rel_filename << "\"";
+        fout << toHex(p.md5sum) << " \"" << db.filenames().directory(p.filename) << db.filenames().basename(p.filename) << "\"";
 
         if (!p.tags().empty())
         {
@@ -192,6 +923,129 @@ void writeDatabase(const PhotoDatabase& db, const std::string& filename)
             fout << " -done";
         }
 
-        fout << std::endl;
+        if (p.stat.valid())
+        {
+            fout << " -stat " << idToStr(p.stat.size) << " " << idToStr(p.stat.mtime) << " "
+                 << idToStr(p.stat.device) << " " << idToStr(p.stat.inode);
+        }
+
+        if (p.fingerprint != 0)
+        {
+            fout << " -fp " << idToStr(p.fingerprint);
+        }
+
+        if (p.has_perceptual_hash)
+        {
+            fout << " -ph " << idToStr(p.perceptual_hash);
+        }
+
+        fout << '\n';
+    }
+
+    if (!db.duplicates().empty())
+        fout << '\n';
+
+    for(const auto& d : db.duplicates())
+    {
+        fout << idToStr(d.second.photo) << " " << toHex(d.second.md5sum) << " \"" << d.first << "\" "
+             << idToStr(d.second.stat.size) << " " << idToStr(d.second.stat.mtime) << " "
+             << idToStr(d.second.stat.device) << " " << idToStr(d.second.stat.inode) << '\n';
+    }
+
+    fout.close();
+    return !fout.fail();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool writeDatabase(const PhotoDatabase& db, const std::string& filename, DatabaseFormat format)
+{
+    if (format == DATABASE_BINARY)
+        return writeBinaryDatabase(db, filename);
+    else
+        return writeTextDatabase(db, filename);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool writeDatabase(const PhotoDatabase& db, const std::string& filename)
+{
+    return writeDatabase(db, filename, databaseFormat(filename));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string journalFilename(const std::string& filename)
+{
+    return filename + ".journal";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void saveDatabase(PhotoDatabase& db, const std::string& filename)
+{
+    static const off_t MIN_COMPACT_SIZE = 1 << 20;
+
+    if (!db.dirty())
+        return;
+
+    struct stat st;
+    if (stat(filename.c_str(), &st) < 0)
+    {
+        compactDatabase(db, filename, DATABASE_TEXT);
+        return;
+    }
+
+    std::string journal_filename = journalFilename(filename);
+    int fd = open(journal_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        std::cout << "Could not write " << journal_filename << ": " << strerror(errno) << std::endl;
+        return;
+    }
+
+    const std::string& changes = db.changes();
+    for(std::size_t written = 0; written < changes.size(); )
+    {
+        ssize_t n = write(fd, changes.data() + written, changes.size() - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            std::cout << "Could not write " << journal_filename << ": " << strerror(errno) << std::endl;
+            close(fd);
+            return;
+        }
+        written += n;
+    }
+
+    struct stat journal_st;
+    bool compact = (fstat(fd, &journal_st) == 0 && journal_st.st_size > std::max(MIN_COMPACT_SIZE, st.st_size / 4));
+    close(fd);
+
+    db.clearChanges();
+
+    if (compact)
+        compactDatabase(db, filename, databaseFormat(filename));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool compactDatabase(PhotoDatabase& db, const std::string& filename, DatabaseFormat format)
+{
+    // Replace the database file in one step, such that a crash leaves either the old or the new one
+    std::string tmp_filename = filename + ".tmp";
+    if (!writeDatabase(db, tmp_filename, format) || rename(tmp_filename.c_str(), filename.c_str()) < 0)
+    {
+        std::cout << "Could not write " << filename << ": " << strerror(errno) << std::endl;
+        unlink(tmp_filename.c_str());
+        return false;
     }
+
+    // If this is cut short, the journal is replayed on top of a file that already contains it, which is
+    // harmless: entries only set values, and photos that exist are skipped
+    unlink(journalFilename(filename).c_str());
+
+    db.clearChanges();
+    return true;
 }
@@ -3,139 +3,603 @@
 
 #include <vector>
 #include <string>
-#include <set>
 #include <map>
+#include <memory>
+#include <functional>
 
 #include <algorithm>
 
+#include "bitmap.h"
+#include "tag_set.h"
+#include "hash_index.h"
+#include "filename_table.h"
+#include "md5sum.h"
+#include "cow_ptr.h"
+#include "concept_index.h"
+
 typedef unsigned long Id;
 
 // ----------------------------------------------------------------------------------------------------
 
-struct PhotoData
+// File system meta data of a photo as seen during the last scan. An mtime of zero means the photo has
+// not been stat'ed yet (e.g., it was loaded from an older database).
+
+struct FileStat
 {
-    PhotoData(Id id) : id_(id), done_(false) {}
+    FileStat() : size(0), mtime(0), device(0), inode(0) {}
 
-    std::string md5sum;
-    std::string rel_filename;
+    unsigned long size;
+    unsigned long mtime;    // nanoseconds since epoch
+    unsigned long device;
+    unsigned long inode;
 
-    void addTag(Id tag)
+    bool valid() const { return mtime != 0; }
+
+    bool operator==(const FileStat& other) const
     {
-        tags_.insert(tag);
+        return size == other.size && mtime == other.mtime && device == other.device && inode == other.inode;
     }
 
+    bool operator!=(const FileStat& other) const { return !(*this == other); }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+struct PhotoData
+{
+    PhotoData(Id id) : fingerprint(0), perceptual_hash(0), has_perceptual_hash(false), id_(id), done_(false) {}
+
+    Md5Digest md5sum;
+
+    // Relative to the photo prefix path, see PhotoDatabase::filename()
+    FilenameHandle filename;
+
+    FileStat stat;
+
+    // Partial hash of the file (see partialHash()), zero if unknown
+    unsigned long fingerprint;
+
+    // Hash of the pixels, such that similar photos have hashes that differ in few bits (see
+    // perceptual_hash.h). Only valid if has_perceptual_hash.
+    unsigned long perceptual_hash;
+
+    bool has_perceptual_hash;
+
     Id id() const { return id_; }
 
-    const std::set<Id>& tags() const { return tags_; }
+    const TagSet<Id, 4>& tags() const { return tags_; }
 
-    bool hasTag(Id tag) const { return tags_.find(tag) != tags_.end(); }
+    bool hasTag(Id tag) const { return tags_.contains(tag); }
 
+    // Use PhotoDatabase::setPhotoDone() on photos of a database, which records the change
     void setDone(bool b = true) { done_ = b; }
 
     bool isDone() const { return done_; }
 
 private:
 
+    friend class PhotoDatabase;
+    friend struct PhotoBatch;
+
     Id id_;
 
-    std::set<Id> tags_;
+    TagSet<Id, 4> tags_;
 
     bool done_;
 
-//    time_t last_seen_;
+    // Use PhotoDatabase::addPhotoTag(), which keeps the tag index up to date. Returns false if the photo
+    // already has the tag.
+    bool addTag(Id tag)
+    {
+        return tags_.insert(tag);
+    }
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// A byte-identical copy of a photo at another path, which is not a photo of its own. Scans remember its
+// stat, such that an unchanged copy is skipped like an unchanged photo instead of being hashed again.
+
+struct KnownDuplicate
+{
+    KnownDuplicate() : photo(0) {}
+
+    Id photo;
+
+    // Of the photo when the copy was found; the copy is hashed again if the photo has changed since
+    Md5Digest md5sum;
+
+    FileStat stat;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Photos by id, stored in chunks that never move, such that adding photos does not invalidate pointers to
+// the others. Copies of a store share their chunks until either copy changes them (see CowPtr), so copying
+// only costs a pointer per chunk.
+
+class PhotoStore
+{
+
+public:
+
+    static const std::size_t CHUNK_BITS = 10;
+
+    static const std::size_t CHUNK_SIZE = 1 << CHUNK_BITS;
+
+    class const_iterator
+    {
+
+    public:
+
+        const_iterator(const PhotoStore* store, Id id) : store_(store), id_(id) {}
+
+        const PhotoData& operator*() const { return (*store_)[id_]; }
+
+        const PhotoData* operator->() const { return &(*store_)[id_]; }
+
+        const_iterator& operator++() { ++id_; return *this; }
+
+        bool operator==(const const_iterator& other) const { return id_ == other.id_; }
+
+        bool operator!=(const const_iterator& other) const { return id_ != other.id_; }
+
+    private:
+
+        const PhotoStore* store_;
+
+        Id id_;
+
+    };
+
+    PhotoStore() : size_(0) {}
+
+    std::size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+    const PhotoData& operator[](Id id) const { return chunks_[id >> CHUNK_BITS]->photos[id & (CHUNK_SIZE - 1)]; }
+
+    const_iterator begin() const { return const_iterator(this, 0); }
+
+    const_iterator end() const { return const_iterator(this, size_); }
+
+    // Copies the photo's chunk first if another store shares it
+    PhotoData& write(Id id) { return chunks_[id >> CHUNK_BITS].write().photos[id & (CHUNK_SIZE - 1)]; }
+
+    PhotoData& push_back(PhotoData&& p)
+    {
+        if (size_ % CHUNK_SIZE == 0)
+            chunks_.push_back(CowPtr<Chunk>());
+
+        Chunk& chunk = chunks_.back().write();
+        chunk.photos.push_back(std::move(p));
+        ++size_;
+        return chunk.photos.back();
+    }
+
+    // Moves the photos of 'other' to the end. If this store ends on a chunk boundary, the chunks of 'other'
+    // are taken over as they are.
+    void append(PhotoStore& other)
+    {
+        if (size_ % CHUNK_SIZE == 0)
+        {
+            chunks_.insert(chunks_.end(), other.chunks_.begin(), other.chunks_.end());
+            size_ += other.size_;
+        }
+        else
+        {
+            for(Id id = 0; id < other.size_; ++id)
+                push_back(std::move(other.write(id)));
+        }
+
+        other.chunks_.clear();
+        other.size_ = 0;
+    }
+
+private:
+
+    struct Chunk
+    {
+        Chunk() { photos.reserve(CHUNK_SIZE); }
+
+        Chunk(const Chunk& other)
+        {
+            photos.reserve(CHUNK_SIZE);
+            photos.insert(photos.end(), other.photos.begin(), other.photos.end());
+        }
+
+        std::vector<PhotoData> photos;
+    };
+
+    std::vector<CowPtr<Chunk> > chunks_;
+
+    std::size_t size_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Photos built apart from a database (e.g., from one chunk of the database file on its own thread), to be
+// added with PhotoDatabase::appendPhotos(). The photos already carry the ids they will get there.
+
+struct PhotoBatch
+{
+    PhotoStore photos;
+
+    FilenameTable filenames;
+
+    // Posting list per concept id, by database id
+    std::vector<Bitmap> tag_to_photos;
+
+    void addPhotoTag(PhotoData* p, Id tag)
+    {
+        p->addTag(tag);
+
+        if (tag >= tag_to_photos.size())
+            tag_to_photos.resize(tag + 1);
+        tag_to_photos[tag].add(p->id());
+    }
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Everything a search needs to read. PhotoDatabase::publish() takes a snapshot of this part of the
+// database, which readers on other threads can keep using while the database goes on changing: both
+// share the photos, posting lists, filenames and concepts, and the database copies what it changes.
+
+class PhotoSnapshot
+{
+
+public:
+
+    const PhotoStore& photos() const { return photos_; }
 
+    // Ids of the photos that have the given tag
+    const Bitmap& photosWithTag(Id tag) const
+    {
+        static const Bitmap empty;
+        return tag < tag_to_photos_.size() ? *tag_to_photos_[tag] : empty;
+    }
+
+    // Relative filename of a photo
+    std::string filename(const PhotoData& p) const { return filenames_->filename(p.filename); }
+
+    const FilenameTable& filenames() const { return *filenames_; }
+
+    const std::string& getConcept(Id id) const
+    {
+        return concepts_->names[id];
+    }
+
+    bool getConceptId(const std::string& s, Id& id) const
+    {
+        auto it = concepts_->ids.find(s);
+        if (it != concepts_->ids.end())
+        {
+            id = it->second;
+            return true;
+        }
+
+        return false;
+    }
+
+    const std::vector<std::string>& concepts() const { return concepts_->names; }
+
+    bool conceptExists(const std::string& concept) const
+    {
+        return concepts_->ids.find(concept) != concepts_->ids.end();
+    }
+
+protected:
+
+    PhotoStore photos_;
+
+    // Posting list per concept id
+    std::vector<CowPtr<Bitmap> > tag_to_photos_;
+
+    CowPtr<FilenameTable> filenames_;
+
+    struct ConceptTable
+    {
+        ConceptTable() : first_free(0) {}
+
+        std::vector<std::string> names;
+
+        std::map<std::string, Id> ids;
+
+        // All names below are in use
+        Id first_free;
+    };
+
+    CowPtr<ConceptTable> concepts_;
 
 };
 
 // ----------------------------------------------------------------------------------------------------
 
-class PhotoDatabase
+// Photos, concepts and indexes. A database is changed by one thread at a time. Other threads read the
+// snapshots it publishes (see snapshot()).
+
+class PhotoDatabase : public PhotoSnapshot
 {
 
 public:
 
+    PhotoDatabase() : stat_indexes_built_(true), concept_index_built_(false), todo_index_built_(false), record_changes_(false), published_(new PhotoSnapshot()) {}
+
     PhotoData* addPhoto()
     {
         Id id = photos_.size();
-        photos_.push_back(PhotoData(id));
-        return &photos_.back();
+        return &photos_.push_back(PhotoData(id));
     }
 
     void registerPhoto(PhotoData* p)
     {
-        md5sum_to_photo_[p->md5sum] = p->id();
-        filename_to_photo_[p->rel_filename] = p->id();
+        md5sum_to_photo_.insert(p->id(), Md5sumOf(photos_));
+        filename_to_photo_.insert(p->id(), FilenameOf(photos_, *filenames_));
+        if (record_changes_)
+            recordPhoto(*p);
+
+        if (stat_indexes_built_ && p->stat.valid())
+        {
+            inode_to_photo_[std::make_pair(p->stat.device, p->stat.inode)] = p->id();
+            size_to_photos_[p->stat.size].push_back(p->id());
+        }
+
+        if (todo_index_built_ && p->tags().empty() && !p->isDone())
+            todo_.add(p->id());
+    }
+
+    // Moves the photos of 'batch' to the end of the database, which must be where their ids point. The
+    // md5sum, filename, inode and size indexes are not updated: call rebuildIndexes() or restoreIndexes()
+    // after the last batch.
+    void appendPhotos(PhotoBatch& batch);
+
+    void rebuildIndexes(unsigned int num_threads);
+
+    // Raw slots of the md5sum and filename indexes, to be saved along with the photos and filenames
+    const std::vector<HashSlot>& md5sumIndexSlots() const { return md5sum_to_photo_.slots(); }
+
+    const std::vector<HashSlot>& filenameIndexSlots() const { return filename_to_photo_.slots(); }
+
+    // Restores indexes saved from a database with the same photos and filenames. Returns false (leaving
+    // the indexes empty) if they do not fit the photos.
+    bool restoreIndexes(const HashSlot* md5sum_slots, std::size_t n_md5sum_slots,
+                        const HashSlot* filename_slots, std::size_t n_filename_slots);
+
+    FilenameHandle addFilename(const std::string& rel_filename) { return filenames_.write().add(rel_filename); }
+
+    FilenameHandle addFilename(const char* rel_filename, std::size_t size)
+    {
+        return filenames_.write().add(rel_filename, size);
     }
 
-    PhotoData* findPhoto(const std::string& md5sum)
+    void setPhotoFilename(PhotoData* p, const std::string& rel_filename)
     {
-        auto it = md5sum_to_photo_.find(md5sum);
-        if (it != md5sum_to_photo_.end())
-            return &photos_[it->second];
+        filename_to_photo_.erase(p->id(), FilenameOf(photos_, *filenames_));
+        p->filename = filenames_.write().add(rel_filename);
+        filename_to_photo_.insert(p->id(), FilenameOf(photos_, *filenames_));
+
+        if (record_changes_)
+            recordFilename(*p);
+    }
+
+    void setPhotoMd5sum(PhotoData* p, const Md5Digest& md5sum)
+    {
+        md5sum_to_photo_.erase(p->id(), Md5sumOf(photos_));
+        p->md5sum = md5sum;
+        md5sum_to_photo_.insert(p->id(), Md5sumOf(photos_));
+
+        // The pixels may have changed as well
+        p->has_perceptual_hash = false;
+
+        if (record_changes_)
+            recordMd5sum(*p);
+    }
+
+    void setPhotoPerceptualHash(PhotoData* p, unsigned long hash)
+    {
+        p->perceptual_hash = hash;
+        p->has_perceptual_hash = true;
+
+        if (record_changes_)
+            recordPerceptualHash(*p);
+    }
+
+    // Also records the photo's fingerprint, which is set along with the stat
+    void setPhotoStat(PhotoData* p, const FileStat& stat)
+    {
+        if (record_changes_)
+            recordStat(*p, stat);
+
+        if (!stat_indexes_built_)
+        {
+            p->stat = stat;
+            return;
+        }
+
+        if (p->stat.valid())
+        {
+            auto it = inode_to_photo_.find(std::make_pair(p->stat.device, p->stat.inode));
+            if (it != inode_to_photo_.end() && it->second == p->id())
+                inode_to_photo_.erase(it);
+
+            std::vector<Id>& ids = size_to_photos_[p->stat.size];
+            ids.erase(std::remove(ids.begin(), ids.end(), p->id()), ids.end());
+            if (ids.empty())
+                size_to_photos_.erase(p->stat.size);
+        }
+
+        p->stat = stat;
+        if (p->stat.valid())
+        {
+            inode_to_photo_[std::make_pair(p->stat.device, p->stat.inode)] = p->id();
+            size_to_photos_[p->stat.size].push_back(p->id());
+        }
+    }
+
+    void addPhotoTag(PhotoData* p, Id tag)
+    {
+        if (!p->addTag(tag))
+            return;
+
+        if (record_changes_)
+            recordTag(*p, tag);
+
+        if (tag >= tag_to_photos_.size())
+            tag_to_photos_.resize(tag + 1);
+        tag_to_photos_[tag].write().add(p->id());
+
+        if (concept_index_built_)
+            concept_index_.addUsage(tag);
+        if (todo_index_built_)
+            todo_.remove(p->id());
+    }
+
+    void setPhotoDone(PhotoData* p)
+    {
+        if (p->isDone())
+            return;
+
+        p->setDone();
+        if (record_changes_)
+            recordDone(*p);
+
+        if (todo_index_built_)
+            todo_.remove(p->id());
+    }
+
+    // Copies of photos by relative filename, see KnownDuplicate
+    const std::map<std::string, KnownDuplicate>& duplicates() const { return duplicates_; }
+
+    const KnownDuplicate* findDuplicate(const std::string& rel_filename) const
+    {
+        auto it = duplicates_.find(rel_filename);
+        return (it != duplicates_.end() ? &it->second : nullptr);
+    }
+
+    void setDuplicate(const std::string& rel_filename, const KnownDuplicate& d)
+    {
+        duplicates_[rel_filename] = d;
+        if (record_changes_)
+            recordDuplicate(rel_filename, d);
+    }
+
+    void removeDuplicate(const std::string& rel_filename)
+    {
+        auto it = duplicates_.find(rel_filename);
+        if (it == duplicates_.end())
+            return;
+
+        if (record_changes_)
+            recordRemoveDuplicate(rel_filename, it->second);
+        duplicates_.erase(it);
+    }
+
+    // The photos found by the functions below are read-only, use photo() to change them
+
+    const PhotoData* findPhoto(const Md5Digest& md5sum) const
+    {
+        Id id;
+        if (md5sum_to_photo_.find(md5sum, Md5sumOf(photos_), id))
+            return &photos_[id];
         else
             return nullptr;
     }
 
-    PhotoData* findPhotoByFilename(const std::string& filename)
+    const PhotoData* findPhotoByFilename(const std::string& filename) const
     {
-        auto it = filename_to_photo_.find(filename);
-        if (it != filename_to_photo_.end())
-            return &photos_[it->second];
+        FilenameKey key;
+        Id id;
+        if (filenames_->lookup(filename, key) && filename_to_photo_.find(key, FilenameOf(photos_, *filenames_), id))
+            return &photos_[id];
         else
             return nullptr;
     }
 
-    void addConcept(const std::string& concept, Id id)
+    const PhotoData* findPhotoByInode(unsigned long device, unsigned long inode)
     {
-        if (id >= concepts_.size())
-            concepts_.resize(id + 1);
-        concepts_[id] = concept;
-        concept_to_id_[concept] = id;
+        if (!stat_indexes_built_)
+            buildStatIndexes();
+
+        auto it = inode_to_photo_.find(std::make_pair(device, inode));
+        if (it != inode_to_photo_.end())
+            return &photos_[it->second];
+        else
+            return nullptr;
     }
 
-    Id addConcept(const std::string& concept)
+    // Photos that are neither tagged nor done, the work left in the GUI
+    const Bitmap& photosToDo()
     {
-        for(Id i = 0; i < concepts_.size(); ++i)
-        {
-            if (concepts_[i].empty())
-            {
-                addConcept(concept, i);
-                return i;
-            }
-        }
+        if (!todo_index_built_)
+            buildTodoIndex();
 
-        Id id = concepts_.size();
-        addConcept(concept, id);
-        return id;
+        return todo_;
     }
 
-    const std::string& getConcept(Id id) const
+    // Up to 'k' concepts that start with 'prefix', the ones tagged to the most photos first
+    void completeConcept(const std::string& prefix, std::size_t k, std::vector<Id>& completions)
     {
-        return concepts_[id];
+        if (!concept_index_built_)
+            buildConceptIndex();
+
+        concept_index_.complete(concepts_->names, prefix, k, completions);
     }
 
-    bool getConceptId(const std::string& s, Id& id) const
+    void findPhotosBySize(unsigned long size, std::vector<const PhotoData*>& photos)
     {
-        auto it = concept_to_id_.find(s);
-        if (it != concept_to_id_.end())
-        {
-            id = it->second;
-            return true;
-        }
+        if (!stat_indexes_built_)
+            buildStatIndexes();
 
-        return false;
+        auto it = size_to_photos_.find(size);
+        if (it == size_to_photos_.end())
+            return;
+
+        for(Id id : it->second)
+            photos.push_back(&photos_[id]);
     }
 
-    const std::vector<std::string>& concepts() const { return concepts_; }
+    // A photo to change, either directly or through the functions above. Stays valid until the next
+    // publish().
+    PhotoData* photo(Id id) { return &photos_.write(id); }
 
-    bool conceptExists(const std::string& concept) const
+    void addConcept(const std::string& concept, Id id)
     {
-        return concept_to_id_.find(concept) != concept_to_id_.end();
+        ConceptTable& concepts = concepts_.write();
+        if (id >= concepts.names.size())
+            concepts.names.resize(id + 1);
+
+        bool unused = concepts.names[id].empty();
+        concepts.names[id] = concept;
+        concepts.ids[concept] = id;
+
+        // A concept that is renamed moves in the index, which is easier to build anew
+        if (concept_index_built_ && unused && !concept.empty())
+            concept_index_.add(concepts.names, id);
+        else
+            concept_index_built_ = false;
+
+        if (concept.empty() && id < concepts.first_free)
+            concepts.first_free = id;
+
+        if (record_changes_)
+            recordConcept(id);
     }
 
-    std::vector<PhotoData>& photos() { return photos_; }
+    // Takes the lowest unused id. Names are not removed, so the search goes on where the last one ended.
+    Id addConcept(const std::string& concept)
+    {
+        ConceptTable& concepts = concepts_.write();
+        while(concepts.first_free < concepts.names.size() && !concepts.names[concepts.first_free].empty())
+            ++concepts.first_free;
 
-    const std::vector<PhotoData>& photos() const { return photos_; }
+        Id id = concepts.first_free;
+        addConcept(concept, id);
+        return id;
+    }
 
     void setPhotoPrefixPath(const std::string& path)
     {
@@ -146,26 +610,150 @@ public:
 
     const std::string& photoPrefixPath() const { return photo_prefix_path_; }
 
+    // Once enabled, changes made through the functions above are recorded as journal entries (see
+    // saveDatabase()), such that saving does not need to rewrite the whole database
+    void setRecordChanges(bool b) { record_changes_ = b; }
+
+    bool dirty() const { return !changes_.empty(); }
+
+    const std::string& changes() const { return changes_; }
+
+    void clearChanges() { changes_.clear(); }
+
+    // Makes the current state what snapshot() returns. Costs a pointer per chunk of photos and per
+    // concept, but afterwards the first change to each chunk, posting list, the filenames or the concepts
+    // copies it.
+    void publish()
+    {
+        std::shared_ptr<const PhotoSnapshot> snapshot(new PhotoSnapshot(*this));
+        std::atomic_store(&published_, snapshot);
+    }
+
+    // The state as of the last publish(), which may be called on any thread
+    std::shared_ptr<const PhotoSnapshot> snapshot() const { return std::atomic_load(&published_); }
+
 private:
 
-    std::vector<PhotoData> photos_;
+    struct Md5sumHash
+    {
+        std::size_t operator()(const Md5Digest& md5sum) const
+        {
+            // Digests are uniformly distributed, but mix both halves anyway in case a database holds
+            // made-up or placeholder values
+            uint64_t a, b;
+            memcpy(&a, md5sum.bytes, sizeof(a));
+            memcpy(&b, md5sum.bytes + sizeof(a), sizeof(b));
+            uint64_t h = a ^ (b * 0x9e3779b97f4a7c15ull);
+            h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+            return h ^ (h >> 33);
+        }
+    };
 
-    std::map<std::string, Id> md5sum_to_photo_;
+    // Keys of the hash indexes are read from the photos themselves
+    struct Md5sumOf
+    {
+        Md5sumOf(const PhotoStore& p) : photos(p) {}
+        const Md5Digest& operator()(Id id) const { return photos[id].md5sum; }
+        const PhotoStore& photos;
+    };
+
+    struct FilenameOf
+    {
+        FilenameOf(const PhotoStore& p, const FilenameTable& f) : photos(p), filenames(f) {}
+        FilenameKey operator()(Id id) const { return filenames.key(photos[id].filename); }
+        const PhotoStore& photos;
+        const FilenameTable& filenames;
+    };
+
+    HashIndex<Md5Digest, Md5sumHash> md5sum_to_photo_;
+
+    HashIndex<FilenameKey, FilenameKeyHash> filename_to_photo_;
+
+    // Only scans need the inode and size indexes, so after loading they are built on first use
+    bool stat_indexes_built_;
+
+    std::map<std::pair<unsigned long, unsigned long>, Id> inode_to_photo_;
+
+    std::map<unsigned long, std::vector<Id> > size_to_photos_;
+
+    void buildStatIndexes();
 
-    std::map<std::string, Id> filename_to_photo_;
+    // Only the GUI completes concepts, so the index is built on first use and kept up to date from then on
+    bool concept_index_built_;
 
-    std::vector<std::string> concepts_;
+    ConceptIndex concept_index_;
 
-    std::map<std::string, Id> concept_to_id_;
+    void buildConceptIndex();
+
+    // Also for the GUI
+    bool todo_index_built_;
+
+    Bitmap todo_;
+
+    void buildTodoIndex();
+
+    std::map<std::string, KnownDuplicate> duplicates_;
 
     std::string photo_prefix_path_;
 
+    bool record_changes_;
+
+    // Journal entries, one per line
+    std::string changes_;
+
+    std::shared_ptr<const PhotoSnapshot> published_;
+
+    void recordConcept(Id id);
+
+    void recordPhoto(const PhotoData& p);
+
+    void recordFilename(const PhotoData& p);
+
+    void recordMd5sum(const PhotoData& p);
+
+    void recordStat(const PhotoData& p, const FileStat& stat);
+
+    void recordPerceptualHash(const PhotoData& p);
+
+    void recordDuplicate(const std::string& rel_filename, const KnownDuplicate& d);
+
+    void recordRemoveDuplicate(const std::string& rel_filename, const KnownDuplicate& d);
+
+    void recordTag(const PhotoData& p, Id tag);
+
+    void recordDone(const PhotoData& p);
+
 };
 
 // ----------------------------------------------------------------------------------------------------
 
+enum DatabaseFormat
+{
+    DATABASE_TEXT,
+    DATABASE_BINARY     // See binary_database.h
+};
+
+// Format of an existing database file, text if there is none
+DatabaseFormat databaseFormat(const std::string& filename);
+
+// Loads a database in either format
 bool loadDatabase(const std::string filename, PhotoDatabase& db);
 
-void writeDatabase(const PhotoDatabase& db, const std::string& filename);
+// Returns false if the file could not be written
+bool writeDatabase(const PhotoDatabase& db, const std::string& filename, DatabaseFormat format);
+
+// Writes in the format of the existing file
+bool writeDatabase(const PhotoDatabase& db, const std::string& filename);
+
+// Changes since the database file was last written are appended to its journal, which loadDatabase()
+// replays on top of the file
+std::string journalFilename(const std::string& filename);
+
+// Appends the changes recorded in 'db' to the journal, and folds the journal into the database file once
+// it has grown past a quarter of the file. Writes nothing if there are no changes.
+void saveDatabase(PhotoDatabase& db, const std::string& filename);
+
+// Writes the database file from scratch, replacing the old one and its journal
+bool compactDatabase(PhotoDatabase& db, const std::string& filename, DatabaseFormat format);
 
 #endif
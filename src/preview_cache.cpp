@@ -0,0 +1,446 @@
+#include "preview_cache.h"
+
+#include "parallel_for.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <set>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Temporary files of store() older than this are taken for leftovers of interrupted writes
+static const long TMP_FILE_MAX_AGE_S = 3600;
+
+// Calls f(marker, fin, length) for the segments of a JPEG before its image data, with 'fin' at the start of
+// the segment's 'length' bytes, until f returns true. Returns false if it never does or the file is not a
+// JPEG.
+template<typename F>
+bool findSegment(const std::string& filename, const F& f)
+{
+    std::ifstream fin(filename.c_str(), std::ios::binary);
+
+    unsigned char b[4];
+    if (!fin.read((char*)b, 2) || b[0] != 0xff || b[1] != 0xd8)
+        return false;
+
+    // Each segment is a marker and a big-endian length that includes itself
+    while(fin.read((char*)b, 4))
+    {
+        unsigned char marker = b[1];
+        unsigned int length = (b[2] << 8) | b[3];
+        if (b[0] != 0xff || length < 2 || marker == 0xda || marker == 0xd9)
+            return false;
+
+        std::streampos next = fin.tellg() + std::streamoff(length - 2);
+        if (f(marker, fin, length - 2))
+            return true;
+
+        fin.clear();
+        fin.seekg(next);
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Reads the size of a JPEG from its frame header
+bool jpegSize(const std::string& filename, int& width, int& height)
+{
+    width = height = 0;
+    findSegment(filename, [&width, &height](unsigned char marker, std::ifstream& fin, unsigned int length)
+    {
+        // SOF0 to SOF15, except DHT, JPG and DAC
+        if (marker < 0xc0 || marker > 0xcf || marker == 0xc4 || marker == 0xc8 || marker == 0xcc)
+            return false;
+
+        unsigned char b[5];
+        if (length >= 5 && fin.read((char*)b, 5))
+        {
+            height = (b[1] << 8) | b[2];
+            width = (b[3] << 8) | b[4];
+        }
+        return true;
+    });
+
+    return width > 0 && height > 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Reads the thumbnail JPEG that cameras embed in the EXIF data (IFD1), and the orientation of the photo
+// (IFD0), which applies to the thumbnail as well
+bool exifThumbnail(const std::string& filename, std::vector<unsigned char>& thumbnail, int& orientation)
+{
+    std::vector<unsigned char> exif;
+    bool found = findSegment(filename, [&exif](unsigned char marker, std::ifstream& fin, unsigned int length)
+    {
+        if (marker != 0xe1 || length < 14)
+            return false;
+
+        exif.resize(length);
+        return fin.read((char*)exif.data(), length) && memcmp(exif.data(), "Exif\0\0", 6) == 0;
+    });
+
+    if (!found)
+        return false;
+
+    // TIFF header: byte order, 42 and the offset of IFD0. All offsets count from its start.
+    const unsigned char* tiff = exif.data() + 6;
+    std::size_t size = exif.size() - 6;
+    bool little_endian = (tiff[0] == 'I');
+
+    auto u16 = [=](std::size_t offset) -> unsigned long
+    {
+        if (offset + 2 > size)
+            return 0;
+        const unsigned char* b = tiff + offset;
+        return little_endian ? (b[0] | b[1] << 8) : (b[0] << 8 | b[1]);
+    };
+
+    auto u32 = [=](std::size_t offset) -> unsigned long
+    {
+        if (offset + 4 > size)
+            return 0;
+        const unsigned char* b = tiff + offset;
+        return little_endian ? (b[0] | b[1] << 8 | b[2] << 16 | (unsigned long)b[3] << 24)
+                             : ((unsigned long)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3]);
+    };
+
+    if (tiff[0] != tiff[1] || (tiff[0] != 'I' && tiff[0] != 'M') || u16(2) != 42)
+        return false;
+
+    orientation = 1;
+    unsigned long jpeg_offset = 0;
+    unsigned long jpeg_length = 0;
+
+    std::size_t ifd = u32(4);
+    for(int i = 0; i < 2 && ifd != 0; ++i)
+    {
+        unsigned int num_entries = u16(ifd);
+        for(unsigned int j = 0; j < num_entries; ++j)
+        {
+            std::size_t entry = ifd + 2 + 12 * j;
+            unsigned long tag = u16(entry);
+            if (i == 0 && tag == 0x0112)
+                orientation = u16(entry + 8);
+            else if (i == 1 && tag == 0x0201)
+                jpeg_offset = u32(entry + 8);
+            else if (i == 1 && tag == 0x0202)
+                jpeg_length = u32(entry + 8);
+        }
+
+        ifd = u32(ifd + 2 + 12 * num_entries);
+    }
+
+    if (jpeg_length == 0 || jpeg_offset + jpeg_length > size)
+        return false;
+
+    thumbnail.assign(tiff + jpeg_offset, tiff + jpeg_offset + jpeg_length);
+    return true;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat decodeToFit(const std::string& filename, int width, int height)
+{
+    // The photo may be turned by its EXIF orientation, so reduce no further than either way round allows
+    int flags = cv::IMREAD_COLOR;
+    int jpeg_width, jpeg_height;
+    if (jpegSize(filename, jpeg_width, jpeg_height))
+    {
+        double f = std::max(std::min((double)width / jpeg_width, (double)height / jpeg_height),
+                            std::min((double)width / jpeg_height, (double)height / jpeg_width));
+
+        if (f <= 1.0 / 8)
+            flags = cv::IMREAD_REDUCED_COLOR_8;
+        else if (f <= 1.0 / 4)
+            flags = cv::IMREAD_REDUCED_COLOR_4;
+        else if (f <= 1.0 / 2)
+            flags = cv::IMREAD_REDUCED_COLOR_2;
+    }
+
+    cv::Mat img = cv::imread(filename, flags);
+    if (!img.data)
+        return cv::Mat();
+
+    cv::Mat result;
+    double f = std::min((double)width / img.cols, (double)height / img.rows);
+    cv::resize(img, result, cv::Size(), f, f, cv::INTER_AREA);
+    return result;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat decodePreview(const std::string& filename)
+{
+    return decodeToFit(filename, PREVIEW_WIDTH, PREVIEW_HEIGHT);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat decodeEmbeddedPreview(const std::string& filename)
+{
+    std::vector<unsigned char> thumbnail;
+    int orientation;
+    if (!exifThumbnail(filename, thumbnail, orientation))
+        return cv::Mat();
+
+    cv::Mat img = cv::imdecode(thumbnail, cv::IMREAD_COLOR);
+    if (!img.data)
+        return cv::Mat();
+
+    // imread() turns the photo itself the same way
+    if (orientation >= 5 && orientation <= 8)
+    {
+        cv::Mat transposed;
+        cv::transpose(img, transposed);
+        img = transposed;
+    }
+
+    int flip_code = 2;
+    if (orientation == 2 || orientation == 6)
+        flip_code = 1;
+    else if (orientation == 3 || orientation == 7)
+        flip_code = -1;
+    else if (orientation == 4 || orientation == 8)
+        flip_code = 0;
+
+    if (flip_code != 2)
+    {
+        cv::Mat flipped;
+        cv::flip(img, flipped, flip_code);
+        img = flipped;
+    }
+
+    cv::Mat preview;
+    double f = std::min((double)PREVIEW_WIDTH / img.cols, (double)PREVIEW_HEIGHT / img.rows);
+    cv::resize(img, preview, cv::Size(), f, f, cv::INTER_LINEAR);
+    return preview;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PreviewCache::PreviewCache(const std::string& dir) : dir_(dir)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat PreviewCache::load(const Md5Digest& md5sum, const std::string& filename) const
+{
+    std::string preview_filename = path(md5sum);
+    cv::Mat preview = cv::imread(preview_filename);
+    if (preview.data)
+    {
+        // The modification time tells trim() when a preview was last used
+        utimes(preview_filename.c_str(), 0);
+        return preview;
+    }
+
+    preview = decodePreview(filename);
+    if (preview.data)
+        store(md5sum, preview);
+
+    return preview;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PreviewCache::contains(const Md5Digest& md5sum) const
+{
+    return access(path(md5sum).c_str(), F_OK) == 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long PreviewCache::generate(const PhotoDatabase& db, unsigned int num_threads) const
+{
+    std::vector<std::pair<Md5Digest, std::string> > missing;
+    std::set<std::string> seen;
+    for(const PhotoData& p : db.photos())
+    {
+        if (!contains(p.md5sum) && seen.insert(toHex(p.md5sum)).second)
+            missing.push_back(std::make_pair(p.md5sum, db.photoPrefixPath() + db.filename(p)));
+    }
+
+    // Photos differ a lot in size, so threads take one at a time
+    std::atomic<std::size_t> next(0);
+    std::atomic<unsigned long> n_made(0);
+    std::mutex out_mutex;
+
+    num_threads = std::max(1u, num_threads);
+    parallelFor(num_threads, num_threads, [&](std::size_t, std::size_t)
+    {
+        for(std::size_t i = next++; i < missing.size(); i = next++)
+        {
+            cv::Mat preview = decodePreview(missing[i].second);
+            if (preview.data && store(missing[i].first, preview))
+            {
+                ++n_made;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> lock(out_mutex);
+                std::cout << "Cannot make a preview of '" << missing[i].second << "'" << std::endl;
+            }
+        }
+    });
+
+    return n_made;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PreviewCache::trim(const PhotoDatabase& db, unsigned long max_bytes) const
+{
+    struct File
+    {
+        unsigned long mtime;
+        unsigned long size;
+        std::string path;
+
+        bool operator<(const File& other) const { return mtime < other.mtime; }
+    };
+
+    std::vector<File> files;
+    unsigned long total_bytes = 0;
+    unsigned long n_removed = 0, removed_bytes = 0;
+
+    DIR* dir = opendir(dir_.c_str());
+    if (!dir)
+        return;
+
+    time_t now = time(0);
+
+    while(dirent* d = readdir(dir))
+    {
+        if (d->d_name[0] == '.')
+            continue;
+
+        std::string subdir_name = dir_ + "/" + d->d_name;
+        DIR* subdir = opendir(subdir_name.c_str());
+        if (!subdir)
+            continue;
+
+        while(dirent* e = readdir(subdir))
+        {
+            std::string name = e->d_name;
+            File file;
+            file.path = subdir_name + "/" + name;
+
+            struct stat st;
+            if (name[0] == '.' || stat(file.path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                continue;
+
+            file.mtime = st.st_mtime;
+            file.size = st.st_size;
+
+            // Another process may still be writing a recent temporary file
+            if (name.find(".tmp.") != std::string::npos && now - st.st_mtime < TMP_FILE_MAX_AGE_S)
+                continue;
+
+            // Previews of photos that are gone, and leftovers of interrupted writes
+            Md5Digest md5sum;
+            if (name.size() != 36 || name.compare(32, 4, ".jpg") != 0 || !fromHex(name.data(), 32, md5sum) ||
+                !db.findPhoto(md5sum))
+            {
+                unlink(file.path.c_str());
+                ++n_removed;
+                removed_bytes += file.size;
+                continue;
+            }
+
+            files.push_back(file);
+            total_bytes += file.size;
+        }
+
+        closedir(subdir);
+    }
+
+    closedir(dir);
+
+    std::sort(files.begin(), files.end());
+
+    std::size_t i = 0;
+    for(; i < files.size() && total_bytes > max_bytes; ++i)
+    {
+        unlink(files[i].path.c_str());
+        total_bytes -= files[i].size;
+        ++n_removed;
+        removed_bytes += files[i].size;
+    }
+
+    std::cout << "Removed " << n_removed << " previews (" << (removed_bytes >> 20) << " MB), " << (files.size() - i)
+              << " previews (" << (total_bytes >> 20) << " MB) left" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string PreviewCache::path(const Md5Digest& md5sum) const
+{
+    std::string hex = toHex(md5sum);
+    return dir_ + "/" + hex.substr(0, 2) + "/" + hex + ".jpg";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PreviewCache::store(const Md5Digest& md5sum, const cv::Mat& preview) const
+{
+    std::vector<int> params;
+    params.push_back(cv::IMWRITE_JPEG_QUALITY);
+    params.push_back(90);
+
+    std::vector<unsigned char> data;
+    if (!cv::imencode(".jpg", preview, data, params))
+        return false;
+
+    std::string filename = path(md5sum);
+    mkdir(dir_.c_str(), 0755);
+    mkdir(filename.substr(0, filename.rfind('/')).c_str(), 0755);
+
+    // Unique per thread, such that concurrent writers of the same preview do not get into each other's way
+    std::ostringstream tmp;
+    tmp << filename << ".tmp." << getpid() << "." << std::this_thread::get_id();
+
+    std::ofstream fout(tmp.str().c_str(), std::ios::binary);
+    fout.write((const char*)data.data(), data.size());
+    fout.close();
+
+    if (fout.fail() || rename(tmp.str().c_str(), filename.c_str()) != 0)
+    {
+        unlink(tmp.str().c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string previewDirectory(const std::string& database_filename)
+{
+    return database_filename + ".previews";
+}
@@ -0,0 +1,70 @@
+#ifndef PHOTO_MANAGER_PREVIEW_CACHE_H_
+#define PHOTO_MANAGER_PREVIEW_CACHE_H_
+
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// Size the GUI shows photos at, and previews are made for
+static const int PREVIEW_WIDTH = 800;
+
+static const int PREVIEW_HEIGHT = 600;
+
+// Decodes a photo scaled to fit into 'width' x 'height'. JPEGs are decoded at 1/2, 1/4 or 1/8 scale where
+// the result is still at least that large, which skips most of the decoding work. Returns an empty Mat if
+// the photo cannot be read.
+cv::Mat decodeToFit(const std::string& filename, int width, int height);
+
+cv::Mat decodePreview(const std::string& filename);
+
+// Decodes the thumbnail a camera embedded in the EXIF data of a JPEG, turned like the photo and scaled up
+// to the preview size. Takes a few milliseconds, for a first look while decodePreview() runs. Returns an
+// empty Mat if there is none.
+cv::Mat decodeEmbeddedPreview(const std::string& filename);
+
+// ----------------------------------------------------------------------------------------------------
+
+// Previews stored as JPEG files named by the md5sum of their photo, such that moved and renamed photos
+// keep their previews, in a directory next to the database (see previewDirectory()). load() adds missing
+// previews as photos are shown; generate() and trim() maintain the cache as a batch, e.g., after a scan.
+// All functions may be called on any thread.
+
+class PreviewCache
+{
+
+public:
+
+    PreviewCache(const std::string& dir);
+
+    // Returns the stored preview of a photo, or decodes and stores it first
+    cv::Mat load(const Md5Digest& md5sum, const std::string& filename) const;
+
+    bool contains(const Md5Digest& md5sum) const;
+
+    // Makes the missing previews of all photos in the database on 'num_threads' threads. Returns the number
+    // of previews made.
+    unsigned long generate(const PhotoDatabase& db, unsigned int num_threads) const;
+
+    // Deletes the previews of photos that are no longer in the database, and then the least recently used
+    // ones until all fit into 'max_bytes'
+    void trim(const PhotoDatabase& db, unsigned long max_bytes) const;
+
+private:
+
+    std::string dir_;
+
+    std::string path(const Md5Digest& md5sum) const;
+
+    // Writes to a temporary file first, such that concurrent readers never see half a preview
+    bool store(const Md5Digest& md5sum, const cv::Mat& preview) const;
+
+};
+
+// Preview directory of a database file
+std::string previewDirectory(const std::string& database_filename);
+
+#endif
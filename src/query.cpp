@@ -0,0 +1,609 @@
+#include "query.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+
+// ----------------------------------------------------------------------------------------------------
+
+struct QueryNode
+{
+    enum Type { TAG, DONE, UNTAGGED, NOT, AND, OR };
+
+    // How a node is applied by its parent conjunction
+    enum Mode { MATERIALIZE, SUBTRACT, FILTER };
+
+    QueryNode(Type t) : type(t), tag(0), mode(MATERIALIZE), estimate(0), evaluated(false), n_result(0),
+        time_ms(0) {}
+
+    Type type;
+
+    // Concept, for TAG nodes
+    Id tag;
+
+    std::string name;
+
+    std::vector<std::unique_ptr<QueryNode> > children;
+
+    Mode mode;
+
+    double estimate;
+
+    // Filled in by evaluation
+    bool evaluated;
+
+    unsigned long n_result;
+
+    double time_ms;
+
+    Bitmap result;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+typedef std::unique_ptr<QueryNode> NodePtr;
+
+typedef std::chrono::steady_clock Clock;
+
+// ----------------------------------------------------------------------------------------------------
+
+struct Token
+{
+    Token() : literal(false) {}
+
+    std::string text;
+
+    // Quoted or escaped in part, such that it is never taken for an operator
+    bool literal;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Returns false if a quote is not closed
+bool tokenize(const std::string& text, std::vector<Token>& tokens)
+{
+    Token word;
+    bool in_quotes = false;
+    bool in_word = false;
+
+    for(std::size_t i = 0; i < text.size(); ++i)
+    {
+        char c = text[i];
+        if (c == '\\' && i + 1 < text.size())
+        {
+            word.text += text[++i];
+            word.literal = true;
+            in_word = true;
+        }
+        else if (c == '"')
+        {
+            in_quotes = !in_quotes;
+            word.literal = true;
+            in_word = true;
+        }
+        else if (!in_quotes && (c == ' ' || c == '\t' || c == '(' || c == ')'))
+        {
+            if (in_word)
+                tokens.push_back(word);
+            word = Token();
+            in_word = false;
+
+            if (c == '(' || c == ')')
+            {
+                Token paren;
+                paren.text = std::string(1, c);
+                tokens.push_back(paren);
+            }
+        }
+        else
+        {
+            word.text += c;
+            in_word = true;
+        }
+    }
+
+    if (in_word)
+        tokens.push_back(word);
+
+    return !in_quotes;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool isOperator(const Token& token)
+{
+    const std::string& t = token.text;
+    return !token.literal && (t == "AND" || t == "OR" || t == "NOT" || t == "-" || t == "(" || t == ")");
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Recursive descent parser for the grammar in query.h
+class Parser
+{
+
+public:
+
+    Parser(const PhotoSnapshot& db, const std::vector<Token>& tokens) : db_(db), tokens_(tokens), pos_(0) {}
+
+    NodePtr parse(std::string& error)
+    {
+        NodePtr node = parseOr();
+        if (node && pos_ < tokens_.size())
+            fail("Unexpected '" + tokens_[pos_].text + "'");
+
+        if (!error_.empty())
+        {
+            error = error_;
+            return NodePtr();
+        }
+
+        return node;
+    }
+
+private:
+
+    const PhotoSnapshot& db_;
+
+    const std::vector<Token>& tokens_;
+
+    std::size_t pos_;
+
+    std::string error_;
+
+    bool accept(const char* token)
+    {
+        if (pos_ < tokens_.size() && !tokens_[pos_].literal && tokens_[pos_].text == token)
+        {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    NodePtr fail(const std::string& error)
+    {
+        if (error_.empty())
+            error_ = error;
+        return NodePtr();
+    }
+
+    NodePtr parseOr()
+    {
+        NodePtr node = parseAnd();
+        while(node && accept("OR"))
+        {
+            NodePtr rhs = parseAnd();
+            if (!rhs)
+                return NodePtr();
+
+            NodePtr parent(new QueryNode(QueryNode::OR));
+            parent->children.push_back(std::move(node));
+            parent->children.push_back(std::move(rhs));
+            node = std::move(parent);
+        }
+        return node;
+    }
+
+    NodePtr parseAnd()
+    {
+        NodePtr node = parseUnary();
+        while(node && (accept("AND") || accept("-")))
+        {
+            NodePtr rhs = parseUnary();
+            if (!rhs)
+                return NodePtr();
+
+            NodePtr parent(new QueryNode(QueryNode::AND));
+            parent->children.push_back(std::move(node));
+            parent->children.push_back(std::move(rhs));
+            node = std::move(parent);
+        }
+        return node;
+    }
+
+    NodePtr parseUnary()
+    {
+        if (pos_ == tokens_.size())
+            return fail("Unexpected end of query");
+
+        if (accept("NOT"))
+        {
+            NodePtr child = parseUnary();
+            if (!child)
+                return NodePtr();
+
+            NodePtr node(new QueryNode(QueryNode::NOT));
+            node->children.push_back(std::move(child));
+            return node;
+        }
+
+        if (accept("("))
+        {
+            NodePtr node = parseOr();
+            if (node && !accept(")"))
+                return fail("Missing ')'");
+            return node;
+        }
+
+        if (accept("is:done"))
+            return NodePtr(new QueryNode(QueryNode::DONE));
+
+        if (accept("is:untagged"))
+            return NodePtr(new QueryNode(QueryNode::UNTAGGED));
+
+        // Concept names may consist of several words
+        std::string concept;
+        for(; pos_ < tokens_.size() && !isOperator(tokens_[pos_]); ++pos_)
+        {
+            if (!concept.empty())
+                concept += ' ';
+            concept += tokens_[pos_].text;
+        }
+
+        if (concept.empty())
+            return fail("Unexpected '" + tokens_[pos_].text + "'");
+
+        Id tag;
+        if (!db_.getConceptId(concept, tag))
+            return fail("Unknown concept: '" + concept + "'");
+
+        NodePtr node(new QueryNode(QueryNode::TAG));
+        node->tag = tag;
+        node->name = concept;
+        return node;
+    }
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Predicates that can be tested per photo, but have no index
+bool isPredicate(const QueryNode& node)
+{
+    if (node.type == QueryNode::NOT)
+        return isPredicate(*node.children[0]);
+
+    return node.type == QueryNode::DONE || node.type == QueryNode::UNTAGGED;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool matches(const QueryNode& node, const PhotoData& p)
+{
+    switch(node.type)
+    {
+    case QueryNode::DONE:
+        return p.isDone();
+    case QueryNode::UNTAGGED:
+        return p.tags().empty();
+    case QueryNode::NOT:
+        return !matches(*node.children[0], p);
+    default:
+        return false;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Operands of a conjunction are applied in this order: indexed operands by increasing size, then
+// negations (largest first, as they remove the most), then per-photo filters on what is left
+QueryNode::Mode conjunctionMode(const QueryNode& node)
+{
+    if (isPredicate(node))
+        return QueryNode::FILTER;
+    return node.type == QueryNode::NOT ? QueryNode::SUBTRACT : QueryNode::MATERIALIZE;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool compareConjunctionOperands(const NodePtr& a, const NodePtr& b)
+{
+    QueryNode::Mode mode_a = conjunctionMode(*a);
+    QueryNode::Mode mode_b = conjunctionMode(*b);
+    if (mode_a != mode_b)
+        return mode_a < mode_b;
+
+    if (mode_a == QueryNode::SUBTRACT)
+        return a->children[0]->estimate > b->children[0]->estimate;
+
+    return a->estimate < b->estimate;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Simplifies the tree and fills in the estimated number of photos per node, assuming independent tags
+NodePtr plan(NodePtr node, const PhotoSnapshot& db)
+{
+    double n = db.photos().size();
+
+    for(NodePtr& child : node->children)
+        child = plan(std::move(child), db);
+
+    switch(node->type)
+    {
+    case QueryNode::TAG:
+        node->estimate = db.photosWithTag(node->tag).cardinality();
+        break;
+
+    case QueryNode::DONE:
+    case QueryNode::UNTAGGED:
+        // Not indexed, and counting would cost as much as evaluating
+        node->estimate = n / 2;
+        break;
+
+    case QueryNode::NOT:
+        if (node->children[0]->type == QueryNode::NOT)
+            return std::move(node->children[0]->children[0]);
+
+        node->estimate = n - node->children[0]->estimate;
+        break;
+
+    case QueryNode::AND:
+    case QueryNode::OR:
+    {
+        // Merge nested operators of the same kind
+        std::vector<NodePtr> children;
+        for(NodePtr& child : node->children)
+        {
+            if (child->type == node->type)
+            {
+                for(NodePtr& grandchild : child->children)
+                    children.push_back(std::move(grandchild));
+            }
+            else
+            {
+                children.push_back(std::move(child));
+            }
+        }
+        node->children.swap(children);
+
+        double p = 1;
+        for(const NodePtr& child : node->children)
+        {
+            double s = (n > 0 ? child->estimate / n : 0);
+            p *= (node->type == QueryNode::AND ? s : 1 - s);
+        }
+        node->estimate = (node->type == QueryNode::AND ? n * p : n * (1 - p));
+
+        if (node->type == QueryNode::AND)
+        {
+            std::stable_sort(node->children.begin(), node->children.end(), compareConjunctionOperands);
+
+            for(NodePtr& child : node->children)
+                child->mode = conjunctionMode(*child);
+
+            // Without indexed operands, the first predicate has to be evaluated by a scan
+            if (node->children[0]->mode == QueryNode::FILTER)
+                node->children[0]->mode = QueryNode::MATERIALIZE;
+        }
+        else
+        {
+            std::stable_sort(node->children.begin(), node->children.end(),
+                             [](const NodePtr& a, const NodePtr& b) { return a->estimate > b->estimate; });
+        }
+        break;
+    }
+    }
+
+    return node;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const Bitmap& evaluate(QueryNode& node, const PhotoSnapshot& db);
+
+void evaluateConjunction(QueryNode& node, const PhotoSnapshot& db)
+{
+    const PhotoStore& photos = db.photos();
+
+    // Operands are ordered by plan()
+    const Bitmap* current = 0;
+    Bitmap tmp;
+
+    for(NodePtr& child : node.children)
+    {
+        if (current && current->empty())
+            break;
+
+        if (!current)
+        {
+            if (child->mode == QueryNode::SUBTRACT)
+            {
+                node.result.addRange(0, photos.size());
+                current = &node.result;
+            }
+            else
+            {
+                current = &evaluate(*child, db);
+                continue;
+            }
+        }
+
+        if (child->mode == QueryNode::MATERIALIZE)
+        {
+            Bitmap::intersect(*current, evaluate(*child, db), tmp);
+        }
+        else if (child->mode == QueryNode::SUBTRACT)
+        {
+            Clock::time_point start = Clock::now();
+
+            Bitmap::subtract(*current, evaluate(*child->children[0], db), tmp);
+
+            child->evaluated = true;
+            child->n_result = tmp.cardinality();
+            child->time_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+        else
+        {
+            Clock::time_point start = Clock::now();
+
+            std::vector<Id> ids;
+            current->toVector(ids);
+
+            tmp = Bitmap();
+            for(Id id : ids)
+            {
+                if (matches(*child, photos[id]))
+                    tmp.add(id);
+            }
+
+            child->evaluated = true;
+            child->n_result = tmp.cardinality();
+            child->time_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        }
+
+        node.result = std::move(tmp);
+        current = &node.result;
+    }
+
+    if (current != &node.result)
+        node.result = *current;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const Bitmap& evaluate(QueryNode& node, const PhotoSnapshot& db)
+{
+    Clock::time_point start = Clock::now();
+
+    const PhotoStore& photos = db.photos();
+    const Bitmap* result = &node.result;
+
+    switch(node.type)
+    {
+    case QueryNode::TAG:
+        result = &db.photosWithTag(node.tag);
+        break;
+
+    case QueryNode::DONE:
+    case QueryNode::UNTAGGED:
+        for(const PhotoData& p : photos)
+        {
+            if (matches(node, p))
+                node.result.add(p.id());
+        }
+        break;
+
+    case QueryNode::NOT:
+    {
+        if (isPredicate(node))
+        {
+            for(const PhotoData& p : photos)
+            {
+                if (matches(node, p))
+                    node.result.add(p.id());
+            }
+            break;
+        }
+
+        Bitmap all;
+        all.addRange(0, photos.size());
+        Bitmap::subtract(all, evaluate(*node.children[0], db), node.result);
+        break;
+    }
+
+    case QueryNode::AND:
+        evaluateConjunction(node, db);
+        break;
+
+    case QueryNode::OR:
+        for(NodePtr& child : node.children)
+            node.result |= evaluate(*child, db);
+        break;
+    }
+
+    node.evaluated = true;
+    node.n_result = result->cardinality();
+    node.time_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+    return *result;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void explainNode(const QueryNode& node, unsigned int depth, std::ostream& out)
+{
+    out << std::string(2 * depth, ' ');
+
+    if (node.mode == QueryNode::FILTER)
+        out << "FILTER ";
+
+    switch(node.type)
+    {
+    case QueryNode::TAG:      out << "TAG '" << node.name << "'"; break;
+    case QueryNode::DONE:     out << "is:done"; break;
+    case QueryNode::UNTAGGED: out << "is:untagged"; break;
+    case QueryNode::NOT:      out << (node.mode == QueryNode::SUBTRACT ? "MINUS" : "NOT"); break;
+    case QueryNode::AND:      out << "AND"; break;
+    case QueryNode::OR:       out << "OR"; break;
+    }
+
+    out << "  (estimated " << (unsigned long)(node.estimate + 0.5);
+    if (node.evaluated)
+        out << ", actual " << node.n_result << ", " << std::fixed << std::setprecision(3) << node.time_ms << " ms";
+    else
+        out << ", skipped";
+    out << ")" << std::endl;
+
+    for(const NodePtr& child : node.children)
+        explainNode(*child, depth + 1, out);
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+Query::Query()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Query::~Query()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Query::parse(const PhotoSnapshot& db, const std::string& text, std::string& error)
+{
+    std::vector<Token> tokens;
+    if (!tokenize(text, tokens))
+    {
+        error = "Missing '\"'";
+        return false;
+    }
+
+    if (tokens.empty())
+    {
+        error = "Empty query";
+        return false;
+    }
+
+    root_ = Parser(db, tokens).parse(error);
+    if (!root_)
+        return false;
+
+    root_ = plan(std::move(root_), db);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Query::run(const PhotoSnapshot& db, std::vector<Id>& ids)
+{
+    if (root_)
+        evaluate(*root_, db).toVector(ids);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Query::explain(std::ostream& out) const
+{
+    if (root_)
+        explainNode(*root_, 0, out);
+}
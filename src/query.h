@@ -0,0 +1,56 @@
+#ifndef PHOTO_MANAGER_QUERY_H_
+#define PHOTO_MANAGER_QUERY_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// Boolean search over the tags of the photos. From lowest to highest precedence:
+//
+//     query    := and_expr ( OR and_expr )*
+//     and_expr := unary ( ( AND | - ) unary )*
+//     unary    := NOT unary | ( query ) | is:done | is:untagged | <concept>
+//
+// A concept is a sequence of words that are not operators, e.g. 'new york AND NOT winter'. This keeps
+// the 'tag1 - tag2' syntax of earlier versions working as a conjunction. Concepts with parentheses or
+// operators are quoted, e.g. '"new york (2019)" OR "rock - pop"', or have them escaped with a
+// backslash, e.g. 'new york \(2019\)'. A backslash also escapes a quote or another backslash.
+//
+// Before evaluation, the query is turned into a plan: nested operators of the same kind are merged, and
+// the operands of a conjunction are ordered by their estimated number of photos (from the concept
+// cardinalities), such that intersections start small and stop as soon as they are empty. Predicates
+// that are not indexed are applied as filters on the intermediate result where possible.
+
+struct QueryNode;
+
+class Query
+{
+
+public:
+
+    Query();
+
+    ~Query();
+
+    // Returns false on syntax errors and unknown concepts, with a message in 'error'
+    bool parse(const PhotoSnapshot& db, const std::string& text, std::string& error);
+
+    // Evaluates the query. Ids are in increasing order.
+    void run(const PhotoSnapshot& db, std::vector<Id>& ids);
+
+    // Prints the plan with the estimated and actual number of photos and the time spent in each node,
+    // including its children. Only meaningful after run().
+    void explain(std::ostream& out) const;
+
+private:
+
+    std::unique_ptr<QueryNode> root_;
+
+};
+
+#endif
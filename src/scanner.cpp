@@ -0,0 +1,846 @@
+#include "scanner.h"
+
+#include "photo_database.h"
+#include "md5sum.h"
+#include "blocking_queue.h"
+#include "io_uring.h"
+#include "dir_walker.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <openssl/md5.h>
+
+#include <iostream>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <string.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+ScanOptions::ScanOptions() : num_jobs(std::max(1u, std::thread::hardware_concurrency())), direct_io(false),
+    io_backend(SCAN_IO_THREADS), queue_depth(32), read_order(SCAN_ORDER_NONE), order_window(4096),
+    publish_interval_ms(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+enum ScanAction
+{
+    SCAN_NEW,           // Unknown path: hash, then either a move, a duplicate or a new photo
+    SCAN_MODIFIED,      // Known path whose size or mtime changed: re-hash
+    SCAN_MOVED,         // Unknown path identified as a known photo without full hash: update path
+    SCAN_STAT           // Known path without stored stat or fingerprint (older database): record them
+};
+
+struct ScanJob
+{
+    unsigned long seq;
+    ScanAction action;
+    Id photo_id;
+    FileStat stat;
+    unsigned long fingerprint;
+    std::string abs_filename;
+    std::string rel_filename;
+    Md5Digest md5sum;
+    bool failed;
+    std::string error;
+
+    // Position in the read order
+    unsigned long order_key;
+
+    // Photos of the same size whose files have disappeared, with their fingerprints
+    std::vector<std::pair<Id, unsigned long> > candidates;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Returns true if exactly one of the move candidates has the same fingerprint as the job's file
+bool matchCandidates(ScanJob& job)
+{
+    unsigned int n_matches = 0;
+    for(const auto& c : job.candidates)
+    {
+        if (c.second == job.fingerprint)
+        {
+            job.photo_id = c.first;
+            ++n_matches;
+        }
+    }
+
+    return n_matches == 1;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+struct ScanStats
+{
+    ScanStats() : bytes_read(0), num_reads(0) {}
+
+    unsigned long bytes_read;
+    unsigned long num_reads;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// The partial hash is needed before the full hash if it can identify the file as a moved photo, or if it
+// is the only thing to compute. Otherwise it is computed from the same reads as the md5sum.
+bool needsPartialHashFirst(const ScanJob& job)
+{
+    return (job.action == SCAN_NEW && !job.candidates.empty()) || job.action == SCAN_STAT;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void hashJob(FileHasher& hasher, ScanJob& job)
+{
+    job.failed = false;
+
+    if (needsPartialHashFirst(job))
+        hasher.partialHash(job.abs_filename, job.fingerprint);
+
+    // A unique fingerprint match with a vanished photo of the same size is a move; only hash fully if
+    // the cheaper tiers are ambiguous or the file needs to be registered
+    if (job.action == SCAN_NEW && !job.candidates.empty() && matchCandidates(job))
+        job.action = SCAN_MOVED;
+
+    if (job.action == SCAN_NEW || job.action == SCAN_MODIFIED)
+    {
+        if (!hasher.md5sum(job.abs_filename, job.md5sum, job.fingerprint == 0 ? &job.fingerprint : 0))
+        {
+            job.failed = true;
+            job.error = strerror(hasher.error());
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void hashWorker(BlockingQueue<ScanJob>& jobs, BlockingQueue<ScanJob>& results, bool direct_io, ScanStats& stats)
+{
+    FileHasher hasher(1024 * 1024, direct_io);
+
+    ScanJob job;
+    while(jobs.pop(job))
+    {
+        hashJob(hasher, job);
+        results.push(std::move(job));
+    }
+
+    stats.bytes_read = hasher.bytesRead();
+    stats.num_reads = hasher.numReads();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+static const unsigned long URING_CHUNK_SIZE = 512 * 1024;
+
+struct UringSlot
+{
+    UringSlot() : busy(false), fd(-1), buffer(0) {}
+
+    ScanJob job;
+    bool busy;
+
+    int fd;
+    bool direct;
+    unsigned long file_size;
+
+    // Current read
+    bool partial;
+    unsigned long offset;
+    unsigned long size;
+
+    MD5_CTX md5;
+    FingerprintBuilder fingerprint;
+    unsigned char* buffer;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Hashes many files concurrently from a single thread, keeping one read per file in flight
+class UringHashWorker
+{
+
+public:
+
+    UringHashWorker(IoUring& ring, BlockingQueue<ScanJob>& results, bool direct_io, ScanStats& stats)
+        : ring_(ring), results_(results), direct_io_(direct_io), stats_(stats), slots_(ring.capacity()), n_busy_(0)
+    {
+        for(UringSlot& slot : slots_)
+        {
+            void* buffer;
+            if (posix_memalign(&buffer, 4096, URING_CHUNK_SIZE) == 0)
+                slot.buffer = (unsigned char*)buffer;
+        }
+    }
+
+    ~UringHashWorker()
+    {
+        for(UringSlot& slot : slots_)
+            free(slot.buffer);
+    }
+
+    void run(BlockingQueue<ScanJob>& jobs)
+    {
+        bool closed = false;
+        while(true)
+        {
+            // Fill idle slots; only block on the job queue if nothing is in flight
+            bool starved = false;
+            for(unsigned int i = 0; i < slots_.size() && !starved && !closed; ++i)
+            {
+                while(!slots_[i].busy)
+                {
+                    ScanJob job;
+                    if (n_busy_ > 0 ? !jobs.tryPop(job) : !jobs.pop(job))
+                    {
+                        if (n_busy_ == 0)
+                            closed = true;
+                        starved = true;
+                        break;
+                    }
+
+                    start(i, job);
+                }
+            }
+
+            if (n_busy_ == 0)
+            {
+                if (closed)
+                    break;
+                continue;
+            }
+
+            unsigned long i_slot;
+            int res;
+            if (!ring_.wait(i_slot, res))
+            {
+                // The ring broke down; fail everything in flight, and hash the other files without it
+                std::cout << "io_uring failed (" << strerror(-res) << "), hashing the remaining files with "
+                          << "plain reads" << std::endl;
+
+                for(unsigned int i = 0; i < slots_.size(); ++i)
+                {
+                    if (slots_[i].busy)
+                        fail(slots_[i], -res);
+
+                    // The kernel may still write into the buffers of reads that could not be waited for
+                    if (ring_.inFlight() > 0)
+                        slots_[i].buffer = 0;
+                }
+
+                FileHasher hasher(1024 * 1024, direct_io_);
+                ScanJob job;
+                while(jobs.pop(job))
+                {
+                    hashJob(hasher, job);
+                    results_.push(std::move(job));
+                }
+
+                stats_.bytes_read += hasher.bytesRead();
+                stats_.num_reads += hasher.numReads();
+                break;
+            }
+
+            complete(slots_[i_slot], res);
+        }
+    }
+
+private:
+
+    IoUring& ring_;
+
+    BlockingQueue<ScanJob>& results_;
+
+    bool direct_io_;
+
+    ScanStats& stats_;
+
+    std::vector<UringSlot> slots_;
+
+    unsigned int n_busy_;
+
+    void start(unsigned long i_slot, ScanJob& job)
+    {
+        job.failed = false;
+
+        bool partial = needsPartialHashFirst(job);
+        if (!partial && job.action != SCAN_NEW && job.action != SCAN_MODIFIED)
+        {
+            results_.push(std::move(job));
+            return;
+        }
+
+        UringSlot& slot = slots_[i_slot];
+        slot.job = std::move(job);
+        slot.busy = true;
+        ++n_busy_;
+
+        if (!slot.buffer)
+        {
+            fail(slot, ENOMEM);
+            return;
+        }
+
+        // The partial hash reads an unaligned tail, which rules out O_DIRECT
+        slot.direct = direct_io_ && !partial;
+        slot.fd = slot.direct ? open(slot.job.abs_filename.c_str(), O_RDONLY | O_DIRECT) : -1;
+        if (slot.fd < 0)
+        {
+            slot.direct = false;
+            slot.fd = open(slot.job.abs_filename.c_str(), O_RDONLY);
+        }
+
+        struct stat st;
+        if (slot.fd < 0 || fstat(slot.fd, &st) < 0)
+        {
+            fail(slot, errno);
+            return;
+        }
+
+        slot.file_size = st.st_size;
+        if (!slot.direct)
+            posix_fadvise(slot.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        slot.fingerprint.reset();
+
+        if (partial)
+        {
+            slot.partial = true;
+            read(i_slot, 0, std::min(slot.file_size, (slot.file_size > 2 * PARTIAL_HASH_BLOCK_SIZE ? 1 : 2) * PARTIAL_HASH_BLOCK_SIZE));
+        }
+        else
+        {
+            startStreaming(i_slot);
+        }
+    }
+
+    void startStreaming(unsigned long i_slot)
+    {
+        UringSlot& slot = slots_[i_slot];
+        slot.partial = false;
+        MD5_Init(&slot.md5);
+        read(i_slot, 0, URING_CHUNK_SIZE);
+    }
+
+    void read(unsigned long i_slot, unsigned long offset, unsigned long size)
+    {
+        UringSlot& slot = slots_[i_slot];
+        slot.offset = offset;
+        slot.size = size;
+        if (!ring_.read(slot.fd, slot.buffer, size, offset, i_slot))
+            fail(slot, EIO);
+    }
+
+    void complete(UringSlot& slot, int res)
+    {
+        if (res < 0)
+        {
+            fail(slot, -res);
+            return;
+        }
+
+        stats_.bytes_read += res;
+        ++stats_.num_reads;
+
+        unsigned long i_slot = &slot - &slots_[0];
+
+        if (slot.partial)
+        {
+            if ((unsigned long)res != slot.size)
+            {
+                fail(slot, EAGAIN);     // File was truncated
+                return;
+            }
+
+            slot.fingerprint.add(slot.buffer, res);
+
+            if (slot.offset == 0 && slot.file_size > 2 * PARTIAL_HASH_BLOCK_SIZE)
+            {
+                read(i_slot, slot.file_size - PARTIAL_HASH_BLOCK_SIZE, PARTIAL_HASH_BLOCK_SIZE);
+                return;
+            }
+
+            ScanJob& job = slot.job;
+            job.fingerprint = slot.fingerprint.finish(slot.file_size);
+
+            if (job.action == SCAN_NEW && matchCandidates(job))
+                job.action = SCAN_MOVED;
+
+            if (job.action == SCAN_NEW)
+                startStreaming(i_slot);
+            else
+                finish(slot);
+
+            return;
+        }
+
+        MD5_Update(&slot.md5, slot.buffer, res);
+
+        if (slot.job.fingerprint == 0)
+            slot.fingerprint.add(slot.buffer, res);
+
+        if (!slot.direct)
+            posix_fadvise(slot.fd, slot.offset, res, POSIX_FADV_DONTNEED);
+
+        unsigned long end = slot.offset + res;
+        if ((unsigned long)res == slot.size)
+        {
+            read(i_slot, end, URING_CHUNK_SIZE);
+            return;
+        }
+
+        if (end != slot.file_size)
+        {
+            fail(slot, EAGAIN);
+            return;
+        }
+
+        MD5_Final(slot.job.md5sum.bytes, &slot.md5);
+
+        if (slot.job.fingerprint == 0)
+            slot.job.fingerprint = slot.fingerprint.finish(slot.file_size);
+
+        finish(slot);
+    }
+
+    void fail(UringSlot& slot, int error)
+    {
+        slot.job.failed = true;
+        slot.job.error = strerror(error);
+        finish(slot);
+    }
+
+    void finish(UringSlot& slot)
+    {
+        if (slot.fd >= 0)
+            close(slot.fd);
+
+        slot.fd = -1;
+        slot.busy = false;
+        --n_busy_;
+
+        results_.push(std::move(slot.job));
+    }
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Physical offset of the first extent of the file, or zero if unknown
+unsigned long physicalOffset(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    // Room for the header and a single extent
+    unsigned long buffer[(sizeof(fiemap) + sizeof(fiemap_extent)) / sizeof(unsigned long) + 1];
+    memset(buffer, 0, sizeof(buffer));
+
+    fiemap* map = (fiemap*)buffer;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+
+    unsigned long offset = 0;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) == 0 && map->fm_mapped_extents > 0)
+        offset = map->fm_extents[0].fe_physical;
+
+    close(fd);
+    return offset;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void setOrderKey(ScanJob& job, ScanReadOrder order)
+{
+    job.order_key = 0;
+
+    if (order == SCAN_ORDER_EXTENT && job.action != SCAN_MOVED)
+        job.order_key = physicalOffset(job.abs_filename);
+
+    if (job.order_key == 0)
+        job.order_key = job.stat.inode;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool compareOrderKey(const ScanJob& a, const ScanJob& b)
+{
+    return a.order_key < b.order_key;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Returns true if the file the photo was last seen at still exists as that same file
+bool stillExists(const PhotoDatabase& db, const PhotoData& p)
+{
+    FileStat st;
+    if (!statFile(db.photoPrefixPath() + db.filename(p), st))
+        return false;
+
+    return !p.stat.valid() || (st.device == p.stat.device && st.inode == p.stat.inode);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Remembers the job's file as a copy of 'p', such that the next scan skips it while it is unchanged
+void addDuplicate(PhotoDatabase& db, const ScanJob& job, const PhotoData& p)
+{
+    KnownDuplicate d;
+    d.photo = p.id();
+    d.md5sum = p.md5sum;
+    d.stat = job.stat;
+    db.setDuplicate(job.rel_filename, d);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void commit(PhotoDatabase& db, std::mutex& db_mutex, const ScanJob& job)
+{
+    std::lock_guard<std::mutex> lock(db_mutex);
+
+    if (job.failed)
+    {
+        std::cout << "Cannot read '" << job.rel_filename << "': " << job.error << std::endl;
+        return;
+    }
+
+    if (job.action == SCAN_STAT)
+    {
+        db.photo(job.photo_id)->fingerprint = job.fingerprint;
+        db.setPhotoStat(db.photo(job.photo_id), job.stat);
+        return;
+    }
+
+    if (job.action == SCAN_MOVED)
+    {
+        PhotoData* p = db.photo(job.photo_id);
+
+        // Classified before earlier jobs were committed: a copy of the same photo may have claimed it
+        if (db.filename(*p) != job.rel_filename && stillExists(db, *p))
+        {
+            std::cout << "Duplicate: '" << job.rel_filename << "' of '" << db.filename(*p) << "'" << std::endl;
+            addDuplicate(db, job, *p);
+            return;
+        }
+
+        std::cout << "File moved: '" << db.filename(*p) << "'' -> '" << job.rel_filename << "'" << std::endl;
+        db.removeDuplicate(job.rel_filename);
+        db.setPhotoFilename(p, job.rel_filename);
+        db.setPhotoStat(p, job.stat);
+        return;
+    }
+
+    if (job.action == SCAN_MODIFIED)
+    {
+        PhotoData* p = db.photo(job.photo_id);
+        if (p->md5sum != job.md5sum)
+        {
+            std::cout << "File modified: " << job.rel_filename << std::endl;
+            db.setPhotoMd5sum(p, job.md5sum);
+        }
+        p->fingerprint = job.fingerprint;
+        db.setPhotoStat(p, job.stat);
+        return;
+    }
+
+    const PhotoData* found = db.findPhoto(job.md5sum);
+
+    if (found && db.filename(*found) != job.rel_filename && stillExists(db, *found))
+    {
+        std::cout << "Duplicate: '" << job.rel_filename << "' of '" << db.filename(*found) << "'" << std::endl;
+        addDuplicate(db, job, *found);
+    }
+    else if (found)
+    {
+        db.removeDuplicate(job.rel_filename);
+
+        // Old photo, update filename
+        std::cout << "File moved: '" << db.filename(*found) << "'' -> '" << job.rel_filename << "'" << std::endl;
+        PhotoData* p = db.photo(found->id());
+        db.setPhotoFilename(p, job.rel_filename);
+        p->fingerprint = job.fingerprint;
+        db.setPhotoStat(p, job.stat);
+    }
+    else
+    {
+        // New photo
+        std::cout << "New photo: " << job.rel_filename << std::endl;
+        db.removeDuplicate(job.rel_filename);
+        PhotoData* p = db.addPhoto();
+        p->md5sum = job.md5sum;
+        p->filename = db.addFilename(job.rel_filename);
+        p->stat = job.stat;
+        p->fingerprint = job.fingerprint;
+        db.registerPhoto(p);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Applies hash results in sequence order, buffering the ones that arrive early, and publishes the
+// database every 'publish_interval_ms' (if not zero)
+void commitWorker(PhotoDatabase& db, std::mutex& db_mutex, BlockingQueue<ScanJob>& results,
+                  unsigned int publish_interval_ms)
+{
+    std::map<unsigned long, ScanJob> pending;
+    unsigned long next_seq = 0;
+
+    auto last_publish = std::chrono::steady_clock::now();
+
+    ScanJob job;
+    while(results.pop(job))
+    {
+        pending[job.seq] = std::move(job);
+
+        auto it = pending.begin();
+        while(it != pending.end() && it->first == next_seq)
+        {
+            commit(db, db_mutex, it->second);
+            it = pending.erase(it);
+            ++next_seq;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if (publish_interval_ms > 0 && now - last_publish >= std::chrono::milliseconds(publish_interval_ms))
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            db.publish();
+            last_publish = now;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Decides from the file's stat alone what needs to be done and, for unknown paths, collects the photos
+// the file could have been moved from. Returns false if nothing needs to be done.
+bool classify(PhotoDatabase& db, ScanJob& job)
+{
+    job.fingerprint = 0;
+
+    const PhotoData* p = db.findPhotoByFilename(job.rel_filename);
+    if (p)
+    {
+        job.photo_id = p->id();
+
+        if (!p->stat.valid())
+            job.action = SCAN_STAT;
+        else if (p->stat.size != job.stat.size || p->stat.mtime != job.stat.mtime)
+            job.action = SCAN_MODIFIED;
+        else if (p->stat != job.stat || p->fingerprint == 0)
+            job.action = SCAN_STAT;     // e.g., restored from backup onto a different device
+        else
+            return false;
+
+        return true;
+    }
+
+    // An unchanged copy of a photo that has not changed either
+    const KnownDuplicate* d = db.findDuplicate(job.rel_filename);
+    if (d && d->stat == job.stat && db.photos()[d->photo].md5sum == d->md5sum &&
+        stillExists(db, db.photos()[d->photo]))
+    {
+        return false;
+    }
+
+    p = db.findPhotoByInode(job.stat.device, job.stat.inode);
+    if (p && p->stat.size == job.stat.size && p->stat.mtime == job.stat.mtime && !stillExists(db, *p))
+    {
+        job.photo_id = p->id();
+        job.action = SCAN_MOVED;
+        return true;
+    }
+
+    std::vector<const PhotoData*> same_size;
+    db.findPhotosBySize(job.stat.size, same_size);
+    for(const PhotoData* c : same_size)
+    {
+        if (c->fingerprint != 0 && !stillExists(db, *c))
+            job.candidates.push_back(std::make_pair(c->id(), c->fingerprint));
+    }
+
+    job.action = SCAN_NEW;
+    return true;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned long scanFiles(PhotoDatabase& db, const std::string& image_dir, std::vector<PhotoFile>& files,
+                        const ScanOptions& opts)
+{
+    std::string prefix = image_dir;
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/')
+        prefix += '/';
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Start hashing and commit stages
+
+    unsigned int num_jobs = std::max(1u, opts.num_jobs);
+
+    BlockingQueue<ScanJob> jobs(16 * num_jobs);
+    BlockingQueue<ScanJob> results;
+    std::mutex db_mutex;
+
+    IoUring ring;
+    bool use_uring = (opts.io_backend == SCAN_IO_URING);
+    if (use_uring && !ring.init(std::max(1u, opts.queue_depth)))
+    {
+        std::cout << "io_uring is not available, falling back to threads" << std::endl;
+        use_uring = false;
+    }
+
+    std::vector<std::thread> workers;
+    std::vector<ScanStats> stats(use_uring ? 1 : num_jobs);
+
+    if (use_uring)
+    {
+        workers.push_back(std::thread([&]()
+        {
+            UringHashWorker worker(ring, results, opts.direct_io, stats[0]);
+            worker.run(jobs);
+        }));
+    }
+    else
+    {
+        for(unsigned int i = 0; i < num_jobs; ++i)
+            workers.push_back(std::thread(hashWorker, std::ref(jobs), std::ref(results), opts.direct_io,
+                                          std::ref(stats[i])));
+    }
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    std::thread committer(commitWorker, std::ref(db), std::ref(db_mutex), std::ref(results), opts.publish_interval_ms);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Discover files
+
+    unsigned long seq = 0;
+    int i_photo = 0;
+    std::vector<ScanJob> window;
+    for(std::size_t i = 0; i < files.size(); ++i)
+    {
+        ScanJob job;
+        job.rel_filename = std::move(files[i].rel_filename);
+        job.abs_filename = prefix + job.rel_filename;
+        job.stat = files[i].stat;
+
+        bool needs_commit;
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            needs_commit = classify(db, job);
+        }
+
+        if (needs_commit)
+        {
+            job.seq = seq++;
+
+            if (opts.read_order == SCAN_ORDER_NONE)
+            {
+                jobs.push(std::move(job));
+            }
+            else
+            {
+                setOrderKey(job, opts.read_order);
+                window.push_back(std::move(job));
+            }
+        }
+
+        ++i_photo;
+        if (i_photo % 100 == 0)
+        {
+            std::lock_guard<std::mutex> lock(db_mutex);
+            std::cout << i_photo << " photos scanned" << std::endl;
+        }
+
+        // Hand out the files in the window in (approximate) on-disk order
+        if (!window.empty() && (window.size() >= opts.order_window || i + 1 == files.size()))
+        {
+            std::stable_sort(window.begin(), window.end(), compareOrderKey);
+            for(ScanJob& j : window)
+                jobs.push(std::move(j));
+            window.clear();
+        }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Drain the pipeline
+
+    jobs.close();
+    for(std::thread& t : workers)
+        t.join();
+
+    results.close();
+    committer.join();
+
+    if (opts.publish_interval_ms > 0)
+        db.publish();
+
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+    ScanStats total;
+    for(const ScanStats& st : stats)
+    {
+        total.bytes_read += st.bytes_read;
+        total.num_reads += st.num_reads;
+    }
+
+    duration = std::max(duration, 1e-6);
+    std::cout << i_photo << " photos scanned, " << seq << " updated, " << (total.bytes_read >> 20) << " MB read in "
+              << duration << " s (" << (total.bytes_read / 1048576.0 / duration) << " MB/s, "
+              << (unsigned long)(total.num_reads / duration) << " IOPS)" << std::endl;
+
+    return seq;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool scan(PhotoDatabase& db, const std::string& image_dir, const ScanOptions& opts)
+{
+    auto t_walk = std::chrono::steady_clock::now();
+
+    // Finding nothing would forget all known copies as gone
+    std::vector<PhotoFile> files;
+    if (!findPhotoFiles(image_dir, std::max(1u, opts.num_jobs), files))
+    {
+        std::cout << "Cannot open " << image_dir << std::endl;
+        return false;
+    }
+
+    double walk_duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_walk).count();
+    std::cout << "Found " << files.size() << " photo files in " << walk_duration << " s" << std::endl;
+
+    scanFiles(db, image_dir, files, opts);
+
+    // Forget the copies that are gone
+    std::string prefix = image_dir;
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/')
+        prefix += '/';
+
+    std::vector<std::string> gone;
+    for(const auto& d : db.duplicates())
+    {
+        FileStat st;
+        if (!statFile(prefix + d.first, st))
+            gone.push_back(d.first);
+    }
+
+    for(const std::string& rel_filename : gone)
+        db.removeDuplicate(rel_filename);
+
+    return true;
+}
@@ -0,0 +1,70 @@
+#ifndef PHOTO_MANAGER_SCANNER_H_
+#define PHOTO_MANAGER_SCANNER_H_
+
+#include <string>
+#include <vector>
+
+class PhotoDatabase;
+struct PhotoFile;
+
+// ----------------------------------------------------------------------------------------------------
+
+enum ScanIoBackend
+{
+    SCAN_IO_THREADS,    // Blocking reads on 'num_jobs' threads
+    SCAN_IO_URING       // Batched reads of many files through io_uring on a single thread
+};
+
+enum ScanReadOrder
+{
+    SCAN_ORDER_NONE,    // Filename order
+    SCAN_ORDER_INODE,   // Inode number, a cheap approximation of on-disk layout
+    SCAN_ORDER_EXTENT   // Physical offset of the first extent (FIEMAP), falls back to inode
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+struct ScanOptions
+{
+    ScanOptions();
+
+    // Number of directory walking and hashing threads
+    unsigned int num_jobs;
+
+    // Read files with O_DIRECT, bypassing the page cache
+    bool direct_io;
+
+    ScanIoBackend io_backend;
+
+    // Number of reads in flight for the io_uring backend
+    unsigned int queue_depth;
+
+    // Files that need reading are sorted in windows of 'order_window' files
+    ScanReadOrder read_order;
+
+    unsigned int order_window;
+
+    // Publish the database (see PhotoDatabase::publish()) at this interval while committing and once at
+    // the end, for readers on other threads. Zero to not publish at all.
+    unsigned int publish_interval_ms;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Scans 'image_dir' for photos and updates the database. Unchanged files are recognized by their stat
+// and skipped, files moved within a file system by their inode, and other moves by file size and partial
+// hash before falling back to a full md5sum. Files are discovered by walking the directory tree on
+// 'num_jobs' threads (see findPhotoFiles()), hashed by a pool of workers, possibly read in another order
+// (see 'read_order'), and committed to the database by a single thread in filename order, such that the
+// result does not depend on the number of jobs. Returns false, changing nothing, if 'image_dir' cannot be
+// opened, e.g., because its file system is not mounted.
+bool scan(PhotoDatabase& db, const std::string& image_dir, const ScanOptions& opts = ScanOptions());
+
+// ----------------------------------------------------------------------------------------------------
+
+// Same as scan(), but only for the given files (with their stat filled in, in processing order). Returns
+// the number of files that needed more than a stat, i.e., new, modified and moved files.
+unsigned long scanFiles(PhotoDatabase& db, const std::string& image_dir, std::vector<PhotoFile>& files,
+                        const ScanOptions& opts = ScanOptions());
+
+#endif
@@ -0,0 +1,595 @@
+#include "server.h"
+
+#include "photo_database.h"
+#include "commands.h"
+#include "scanner.h"
+#include "blocking_queue.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <set>
+#include <map>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+volatile sig_atomic_t stop_requested = 0;
+
+void onSignal(int)
+{
+    stop_requested = 1;
+}
+
+static const uint32_t MAX_REQUEST_SIZE = 1024 * 1024;
+
+static const uint32_t MAX_RESPONSE_SIZE = 0xffffffff;
+
+static const unsigned int SCAN_PUBLISH_INTERVAL_MS = 1000;
+
+// A client that does not take its response within this time is dropped, such that it cannot hold a worker
+static const int SEND_TIMEOUT_S = 10;
+
+// ----------------------------------------------------------------------------------------------------
+
+bool readFully(int fd, char* data, std::size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t n = read(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool writeFully(int fd, const char* data, std::size_t size)
+{
+    while(size > 0)
+    {
+        // No SIGPIPE if the other side is gone
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+
+        data += n;
+        size -= n;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool readFrame(int fd, std::string& payload, uint32_t max_size)
+{
+    uint32_t size;
+    if (!readFully(fd, (char*)&size, sizeof(size)) || size > max_size)
+        return false;
+
+    payload.resize(size);
+    return readFully(fd, &payload[0], size);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool writeFrame(int fd, const std::string& payload)
+{
+    uint32_t size = payload.size();
+    return writeFully(fd, (const char*)&size, sizeof(size)) && writeFully(fd, payload.data(), payload.size());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool makeAddress(const std::string& socket_filename, sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_filename.size() >= sizeof(addr.sun_path))
+        return false;
+
+    memcpy(addr.sun_path, socket_filename.c_str(), socket_filename.size() + 1);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Returns false if nobody listens on the socket
+bool connectTo(const std::string& socket_filename, int& fd)
+{
+    sockaddr_un addr;
+    if (!makeAddress(socket_filename, addr))
+        return false;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+
+    if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// A tag or scan, answered by the writer thread once it is saved
+struct WriteRequest
+{
+    int fd;
+
+    std::string prefix;
+    std::string command;
+    std::vector<std::string> args;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+class Server
+{
+
+public:
+
+    Server(PhotoDatabase& db, const std::string& database_filename) : db_(db),
+        database_filename_(database_filename), answered_((std::size_t)-1)
+    {
+    }
+
+    void run(int listen_fd, unsigned int num_threads);
+
+private:
+
+    PhotoDatabase& db_;
+
+    std::string database_filename_;
+
+    // Complete requests of clients, read by the thread that accepts connections
+    BlockingQueue<std::pair<int, std::string> > requests_;
+
+    // Clients whose requests were answered, and whether their connection is still fine. Unbounded, such that
+    // workers never wait for the accepting thread while it waits for them; each client has one request at a time.
+    BlockingQueue<std::pair<int, bool> > answered_;
+
+    // Written to after pushing to answered_, to wake up the accepting thread
+    int wake_fds_[2];
+
+    // Only the writer thread changes the database. Readers use the snapshot it last published.
+    BlockingQueue<WriteRequest> writes_;
+
+    void worker();
+
+    void writer();
+
+    // Sends the response and hands the client back to the accepting thread
+    void answer(int fd, const std::string& response);
+
+    // Returns false if the request was passed on to the writer thread, which answers it
+    bool handle(int fd, const std::string& request, std::string& response);
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+void Server::run(int listen_fd, unsigned int num_threads)
+{
+    if (pipe2(wake_fds_, O_CLOEXEC | O_NONBLOCK) < 0)
+    {
+        std::cout << "Could not create a pipe: " << strerror(errno) << std::endl;
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for(unsigned int i = 0; i < num_threads; ++i)
+        workers.push_back(std::thread(&Server::worker, this));
+
+    std::thread writer_thread(&Server::writer, this);
+
+    struct sigaction action, old_int, old_term;
+    action.sa_handler = onSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;    // No SA_RESTART: poll() needs to be interrupted
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    // Open connections with what they sent so far, and those of them with a request at a worker, which
+    // are not polled until it is answered. A worker only ever takes a complete request, such that idle or
+    // slow clients do not hold one.
+    std::map<int, std::string> clients;
+    std::set<int> busy;
+
+    auto closeClient = [&](int fd)
+    {
+        clients.erase(fd);
+        close(fd);
+    };
+
+    // Hands the next request of a client to the workers if it is complete
+    auto dispatch = [&](int fd)
+    {
+        std::string& buffer = clients[fd];
+
+        uint32_t size;
+        if (buffer.size() < sizeof(size))
+            return;
+
+        memcpy(&size, buffer.data(), sizeof(size));
+        if (size > MAX_REQUEST_SIZE)
+        {
+            closeClient(fd);
+            return;
+        }
+
+        if (buffer.size() < sizeof(size) + size)
+            return;
+
+        std::string request = buffer.substr(sizeof(size), size);
+        buffer.erase(0, sizeof(size) + size);
+
+        busy.insert(fd);
+        requests_.push(std::make_pair(fd, std::move(request)));
+    };
+
+    while(!stop_requested)
+    {
+        std::vector<pollfd> pfds;
+        pfds.push_back({ listen_fd, POLLIN, 0 });
+        pfds.push_back({ wake_fds_[0], POLLIN, 0 });
+        for(const auto& client : clients)
+        {
+            if (!busy.count(client.first))
+                pfds.push_back({ client.first, POLLIN, 0 });
+        }
+
+        int r = poll(pfds.data(), pfds.size(), -1);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Take back the clients whose requests were answered
+
+        if (pfds[1].revents)
+        {
+            char drain[64];
+            while(read(wake_fds_[0], drain, sizeof(drain)) > 0)
+                ;
+
+            std::pair<int, bool> answered;
+            while(answered_.tryPop(answered))
+            {
+                busy.erase(answered.first);
+                if (answered.second)
+                    dispatch(answered.first);
+                else
+                    closeClient(answered.first);
+            }
+        }
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Read what the idle clients sent
+
+        for(std::size_t i = 2; i < pfds.size(); ++i)
+        {
+            if (!pfds[i].revents)
+                continue;
+
+            int fd = pfds[i].fd;
+            char data[64 * 1024];
+            ssize_t n = recv(fd, data, sizeof(data), MSG_DONTWAIT);
+            if (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+                continue;
+
+            if (n <= 0)
+            {
+                closeClient(fd);
+                continue;
+            }
+
+            clients[fd].append(data, n);
+            dispatch(fd);
+        }
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // Accept a new client
+
+        if (pfds[0].revents)
+        {
+            int fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+            if (fd >= 0)
+            {
+                timeval timeout;
+                timeout.tv_sec = SEND_TIMEOUT_S;
+                timeout.tv_usec = 0;
+                setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+                clients[fd];
+            }
+        }
+    }
+
+    sigaction(SIGINT, &old_int, 0);
+    sigaction(SIGTERM, &old_term, 0);
+
+    // Answer the requests taken so far
+    requests_.close();
+    for(std::thread& t : workers)
+        t.join();
+
+    writes_.close();
+    writer_thread.join();
+
+    for(const auto& client : clients)
+        close(client.first);
+
+    close(wake_fds_[0]);
+    close(wake_fds_[1]);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Server::worker()
+{
+    std::pair<int, std::string> request;
+    while(requests_.pop(request))
+    {
+        std::string response;
+        if (handle(request.first, request.second, response))
+            answer(request.first, response);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Server::answer(int fd, const std::string& response)
+{
+    bool ok = writeFrame(fd, response);
+    answered_.push(std::make_pair(fd, ok));
+
+    char wake = 0;
+    if (write(wake_fds_[1], &wake, 1) < 0)
+    {
+        // The pipe is full, so the accepting thread will wake up anyway
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void Server::writer()
+{
+    WriteRequest request;
+    while(writes_.pop(request))
+    {
+        // Apply everything that has queued up at once, and persist it with one append to the journal
+        std::vector<WriteRequest> batch(1, std::move(request));
+        while(writes_.tryPop(request))
+            batch.push_back(std::move(request));
+
+        std::vector<std::string> responses;
+        for(WriteRequest& r : batch)
+        {
+            std::ostringstream out;
+            bool ok;
+            if (r.command == "tag")
+            {
+                ok = tagCommand(db_, r.prefix, r.args, out);
+            }
+            else
+            {
+                // Searches see the photos found so far while the scan goes on
+                ScanOptions opts;
+                parseScanOptions(r.args, opts);
+                opts.publish_interval_ms = SCAN_PUBLISH_INTERVAL_MS;
+
+                ok = scan(db_, db_.photoPrefixPath(), opts);
+                if (!ok)
+                {
+                    out << "Cannot open " << db_.photoPrefixPath() << std::endl;
+                }
+                else
+                {
+                    out << "Scanned " << db_.photoPrefixPath() << ": " << db_.photos().size() << " photos" << std::endl;
+
+                    if (std::find(r.args.begin(), r.args.end(), "--previews") != r.args.end())
+                        makePreviews(db_, database_filename_, opts.num_jobs, out);
+                    if (std::find(r.args.begin(), r.args.end(), "--thumbnails") != r.args.end())
+                        makeThumbnails(db_, database_filename_, opts.num_jobs, out);
+                    if (std::find(r.args.begin(), r.args.end(), "--hashes") != r.args.end())
+                        makePerceptualHashes(db_, opts.num_jobs, out);
+                }
+            }
+
+            responses.push_back((ok ? "0" : "1") + out.str());
+        }
+
+        db_.publish();
+        saveDatabase(db_, database_filename_);
+
+        for(std::size_t i = 0; i < batch.size(); ++i)
+            answer(batch[i].fd, responses[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool Server::handle(int fd, const std::string& request, std::string& response)
+{
+    std::vector<std::string> words;
+    for(std::size_t begin = 0; begin <= request.size(); )
+    {
+        std::size_t end = request.find('\0', begin);
+        if (end == std::string::npos)
+            end = request.size();
+
+        words.push_back(request.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    if (words.size() < 2)
+    {
+        response = "1Invalid request\n";
+        return true;
+    }
+
+    std::string prefix = words[0];
+    if (!prefix.empty() && prefix[prefix.size() - 1] != '/')
+        prefix += '/';
+
+    const std::string& command = words[1];
+    std::vector<std::string> args(words.begin() + 2, words.end());
+
+    std::ostringstream out;
+    bool ok;
+
+    if (command == "search" || command == "stat")
+    {
+        std::shared_ptr<const PhotoSnapshot> snapshot = db_.snapshot();
+        if (command == "search")
+            ok = searchCommand(*snapshot, prefix, args, out);
+        else
+            ok = statCommand(*snapshot, out);
+    }
+    else if (command == "tag" || command == "scan")
+    {
+        // A scan can take minutes, which must not hold this worker
+        WriteRequest w;
+        w.fd = fd;
+        w.prefix = prefix;
+        w.command = command;
+        w.args = args;
+        writes_.push(std::move(w));
+        return false;
+    }
+    else
+    {
+        ok = false;
+        out << "Unknown command: " << command << std::endl;
+    }
+
+    response = (ok ? "0" : "1");
+    response += out.str();
+    return true;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string socketFilename(const std::string& database_filename)
+{
+    return database_filename + ".sock";
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool serve(PhotoDatabase& db, const std::string& database_filename, const std::string& socket_filename,
+           unsigned int num_threads)
+{
+    sockaddr_un addr;
+    if (!makeAddress(socket_filename, addr))
+    {
+        std::cout << "Socket path too long: " << socket_filename << std::endl;
+        return false;
+    }
+
+    // A socket file that nobody listens on is left over from a server that did not exit cleanly
+    int fd;
+    if (connectTo(socket_filename, fd))
+    {
+        close(fd);
+        std::cout << "A server is already running on " << socket_filename << std::endl;
+        return false;
+    }
+    unlink(socket_filename.c_str());
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (const sockaddr*)&addr, sizeof(addr)) < 0 || listen(listen_fd, 128) < 0)
+    {
+        std::cout << "Could not listen on " << socket_filename << ": " << strerror(errno) << std::endl;
+        if (listen_fd >= 0)
+            close(listen_fd);
+        return false;
+    }
+
+    std::cout << "Serving " << database_filename << " on " << socket_filename << std::endl;
+
+    db.publish();
+
+    Server server(db, database_filename);
+    server.run(listen_fd, std::max(1u, num_threads));
+
+    close(listen_fd);
+    unlink(socket_filename.c_str());
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool serverRunning(const std::string& socket_filename)
+{
+    int fd;
+    if (!connectTo(socket_filename, fd))
+        return false;
+
+    close(fd);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool sendRequest(const std::string& socket_filename, const std::vector<std::string>& request,
+                 std::string& output, bool& ok)
+{
+    int fd;
+    if (!connectTo(socket_filename, fd))
+        return false;
+
+    std::string payload;
+    for(std::size_t i = 0; i < request.size(); ++i)
+    {
+        if (i > 0)
+            payload += '\0';
+        payload += request[i];
+    }
+
+    std::string response;
+    bool sent = writeFrame(fd, payload) && readFrame(fd, response, MAX_RESPONSE_SIZE) && !response.empty();
+    close(fd);
+
+    if (!sent)
+        return false;
+
+    ok = (response[0] == '0');
+    output = response.substr(1);
+    return true;
+}
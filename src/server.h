@@ -0,0 +1,35 @@
+#ifndef PHOTO_MANAGER_SERVER_H_
+#define PHOTO_MANAGER_SERVER_H_
+
+#include <string>
+#include <vector>
+
+class PhotoDatabase;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Protocol: every message is a frame of a 32-bit length (native byte order) followed by that many bytes.
+// A request holds null-separated words: the image directory of the client, the command and its arguments
+// (see commands.h). The response is a status byte ('0' on success) followed by the command's output.
+// Clients may send any number of requests over one connection.
+
+// Socket of the server of a database file
+std::string socketFilename(const std::string& database_filename);
+
+// Answers requests on 'socket_filename' until SIGINT or SIGTERM. Reads are served concurrently by
+// 'num_threads' threads from the last published snapshot (see PhotoDatabase::publish()). Connections are
+// polled by one thread, which hands each complete request to a free worker, such that idle clients do not
+// hold one; a client that does not take its response in time is dropped. Tags and scans
+// are applied by a single writer thread, which publishes them and appends them to the journal of
+// 'database_filename' (see saveDatabase()) before answering. Scans publish as they go, such that searches
+// do not wait for them. Scans always cover the image directory of the server.
+bool serve(PhotoDatabase& db, const std::string& database_filename, const std::string& socket_filename,
+           unsigned int num_threads);
+
+bool serverRunning(const std::string& socket_filename);
+
+// Sends one request to the server. Returns false if no server is listening on 'socket_filename'.
+bool sendRequest(const std::string& socket_filename, const std::vector<std::string>& request,
+                 std::string& output, bool& ok);
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef PHOTO_MANAGER_TAG_SET_H_
+#define PHOTO_MANAGER_TAG_SET_H_
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Sorted set of ids stored in one flat array. Up to N ids are kept inline, such that most photos need no
+// heap allocation for their tags at all, and iterating over them does not chase pointers.
+
+template<typename T, unsigned int N>
+class TagSet
+{
+
+public:
+
+    typedef const T* const_iterator;
+
+    TagSet() : size_(0), capacity_(INLINE_CAPACITY) {}
+
+    TagSet(const TagSet& other) : size_(0), capacity_(INLINE_CAPACITY)
+    {
+        assign(other);
+    }
+
+    TagSet(TagSet&& other) : size_(other.size_), capacity_(other.capacity_)
+    {
+        memcpy(&storage_, &other.storage_, sizeof(storage_));
+        other.size_ = 0;
+        other.capacity_ = INLINE_CAPACITY;
+    }
+
+    ~TagSet()
+    {
+        if (!isInline())
+            free(storage_.heap);
+    }
+
+    TagSet& operator=(const TagSet& other)
+    {
+        if (this != &other)
+            assign(other);
+        return *this;
+    }
+
+    TagSet& operator=(TagSet&& other)
+    {
+        if (this != &other)
+        {
+            if (!isInline())
+                free(storage_.heap);
+
+            size_ = other.size_;
+            capacity_ = other.capacity_;
+            memcpy(&storage_, &other.storage_, sizeof(storage_));
+            other.size_ = 0;
+            other.capacity_ = INLINE_CAPACITY;
+        }
+        return *this;
+    }
+
+    // Returns false if the value was already present
+    bool insert(T value)
+    {
+        T* it = std::lower_bound(data(), data() + size_, value);
+        if (it != data() + size_ && *it == value)
+            return false;
+
+        std::size_t pos = it - data();
+        if (size_ == capacity_)
+            grow(capacity_ * 2);
+
+        T* d = data();
+        memmove(d + pos + 1, d + pos, (size_ - pos) * sizeof(T));
+        d[pos] = value;
+        ++size_;
+        return true;
+    }
+
+    bool contains(T value) const
+    {
+        const T* d = data();
+
+        // Short sets are faster to search linearly
+        if (size_ <= 8)
+            return std::find(d, d + size_, value) != d + size_;
+
+        return std::binary_search(d, d + size_, value);
+    }
+
+    const_iterator begin() const { return data(); }
+
+    const_iterator end() const { return data() + size_; }
+
+    std::size_t size() const { return size_; }
+
+    bool empty() const { return size_ == 0; }
+
+private:
+
+    static const uint32_t INLINE_CAPACITY = N;
+
+    uint32_t size_;
+
+    uint32_t capacity_;
+
+    union Storage
+    {
+        T values[INLINE_CAPACITY];
+        T* heap;
+    } storage_;
+
+    bool isInline() const { return capacity_ == INLINE_CAPACITY; }
+
+    T* data() { return isInline() ? storage_.values : storage_.heap; }
+
+    const T* data() const { return isInline() ? storage_.values : storage_.heap; }
+
+    void grow(uint32_t capacity)
+    {
+        T* heap = (T*)malloc(capacity * sizeof(T));
+        memcpy(heap, data(), size_ * sizeof(T));
+
+        if (!isInline())
+            free(storage_.heap);
+
+        storage_.heap = heap;
+        capacity_ = capacity;
+    }
+
+    void assign(const TagSet& other)
+    {
+        if (other.size_ > capacity_)
+            grow(other.size_);
+
+        memcpy(data(), other.data(), other.size_ * sizeof(T));
+        size_ = other.size_;
+    }
+
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "thumbnail_atlas.h"
+
+#include "preview_cache.h"
+#include "parallel_for.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <iostream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+static const char THUMBNAIL_ATLAS_MAGIC[8] = { 'P', 'M', 'T', 'H', 'U', 'M', 'B', '1' };
+
+struct AtlasHeader
+{
+    char magic[8];
+    uint32_t thumb_size;
+    uint32_t reserved;
+};
+
+// The md5sum of the photo, then its pixels (BGR, row by row). A tile is valid once the md5sum is written.
+static const std::size_t TILE_BYTES = MD5_DIGEST_SIZE + THUMB_SIZE * THUMB_SIZE * 3;
+
+static const cv::Scalar BACKGROUND(20, 20, 20);
+
+std::size_t tileOffset(Id id)
+{
+    return sizeof(AtlasHeader) + (std::size_t)id * TILE_BYTES;
+}
+
+bool validHeader(const AtlasHeader& header)
+{
+    return memcmp(header.magic, THUMBNAIL_ATLAS_MAGIC, sizeof(header.magic)) == 0 && header.thumb_size == THUMB_SIZE;
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+ThumbnailAtlas::ThumbnailAtlas() : data_(0), size_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+ThumbnailAtlas::~ThumbnailAtlas()
+{
+    close();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool ThumbnailAtlas::open(const std::string& filename)
+{
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    AtlasHeader header;
+    if (fstat(fd, &st) != 0 || (std::size_t)st.st_size < sizeof(header) ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) || !validHeader(header))
+    {
+        ::close(fd);
+        return false;
+    }
+
+    // The mapping stays valid after the file is closed
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (data == MAP_FAILED)
+        return false;
+
+    data_ = (const unsigned char*)data;
+    size_ = st.st_size;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ThumbnailAtlas::close()
+{
+    if (data_)
+        munmap((void*)data_, size_);
+
+    data_ = 0;
+    size_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::Mat ThumbnailAtlas::get(const PhotoData& photo) const
+{
+    std::size_t offset = tileOffset(photo.id());
+    if (!data_ || offset + TILE_BYTES > size_ || memcmp(data_ + offset, photo.md5sum.bytes, MD5_DIGEST_SIZE) != 0)
+        return cv::Mat();
+
+    // buildThumbnails() may rewrite the tile meanwhile: it zeroes the md5sum first, so the copy is only
+    // whole if the md5sum is still there afterwards
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    cv::Mat thumb(THUMB_SIZE, THUMB_SIZE, CV_8UC3);
+    memcpy(thumb.data, data_ + offset + MD5_DIGEST_SIZE, TILE_BYTES - MD5_DIGEST_SIZE);
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (memcmp(data_ + offset, photo.md5sum.bytes, MD5_DIGEST_SIZE) != 0)
+        return cv::Mat();
+
+    return thumb;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+long buildThumbnails(const PhotoDatabase& db, const std::string& filename, unsigned int num_threads)
+{
+    int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        std::cout << "Cannot write " << filename << std::endl;
+        return -1;
+    }
+
+    // An atlas with other tiles is started over
+    AtlasHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || !validHeader(header))
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, THUMBNAIL_ATLAS_MAGIC, sizeof(header.magic));
+        header.thumb_size = THUMB_SIZE;
+
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, &header, sizeof(header), 0) != sizeof(header))
+        {
+            std::cout << "Cannot write " << filename << std::endl;
+            ::close(fd);
+            return -1;
+        }
+    }
+
+    const PhotoStore& photos = db.photos();
+    std::size_t size = tileOffset(photos.size());
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((std::size_t)st.st_size < size && ftruncate(fd, size) != 0))
+    {
+        std::cout << "Cannot write " << filename << std::endl;
+        ::close(fd);
+        return -1;
+    }
+
+    if (photos.empty())
+    {
+        ::close(fd);
+        return 0;
+    }
+
+    void* map = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        std::cout << "Cannot map " << filename << std::endl;
+        return -1;
+    }
+
+    unsigned char* data = (unsigned char*)map;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Decode the photos whose tile is missing or was made of another version of the photo
+
+    std::vector<Id> missing;
+    for(const PhotoData& p : photos)
+    {
+        if (memcmp(data + tileOffset(p.id()), p.md5sum.bytes, MD5_DIGEST_SIZE) != 0)
+            missing.push_back(p.id());
+    }
+
+    // Photos differ a lot in size, so threads take one at a time. Each writes its own tiles.
+    std::atomic<std::size_t> next(0);
+    std::atomic<long> n_made(0);
+    std::mutex out_mutex;
+
+    num_threads = std::max(1u, num_threads);
+    parallelFor(num_threads, num_threads, [&](std::size_t, std::size_t)
+    {
+        for(std::size_t i = next++; i < missing.size(); i = next++)
+        {
+            const PhotoData& p = photos[missing[i]];
+            std::string photo_filename = db.photoPrefixPath() + db.filename(p);
+
+            cv::Mat thumb = decodeToFit(photo_filename, THUMB_SIZE, THUMB_SIZE);
+            if (!thumb.data)
+            {
+                std::lock_guard<std::mutex> lock(out_mutex);
+                std::cout << "Cannot make a thumbnail of '" << photo_filename << "'" << std::endl;
+                continue;
+            }
+
+            // The atlas is shared with GUIs that may have it mapped: invalidate the tile while the pixels
+            // change, and only tag it once they are all written
+            unsigned char* tile = data + tileOffset(p.id());
+            memset(tile, 0, MD5_DIGEST_SIZE);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            cv::Mat pixels(THUMB_SIZE, THUMB_SIZE, CV_8UC3, tile + MD5_DIGEST_SIZE);
+            pixels.setTo(BACKGROUND);
+            thumb.copyTo(pixels(cv::Rect((THUMB_SIZE - thumb.cols) / 2, (THUMB_SIZE - thumb.rows) / 2,
+                                         thumb.cols, thumb.rows)));
+
+            std::atomic_thread_fence(std::memory_order_release);
+            memcpy(tile, p.md5sum.bytes, MD5_DIGEST_SIZE);
+            ++n_made;
+        }
+    });
+
+    munmap(map, size);
+
+    return n_made;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string thumbnailFilename(const std::string& database_filename)
+{
+    return database_filename + ".thumbs";
+}
@@ -0,0 +1,54 @@
+#ifndef PHOTO_MANAGER_THUMBNAIL_ATLAS_H_
+#define PHOTO_MANAGER_THUMBNAIL_ATLAS_H_
+
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "photo_database.h"
+
+// ----------------------------------------------------------------------------------------------------
+
+// Thumbnails are fitted into squares of this size, on the background of the GUI
+static const int THUMB_SIZE = 64;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Thumbnails of all photos as raw pixels in one file, a tile per photo at an offset given by its id, each
+// tagged with the md5sum of the photo it was made of. The GUI maps it and shows a page of thumbnails
+// without decoding anything; buildThumbnails() adds the missing ones, e.g., after a scan.
+
+class ThumbnailAtlas
+{
+
+public:
+
+    ThumbnailAtlas();
+
+    ~ThumbnailAtlas();
+
+    // Maps an atlas file for reading. Returns false if there is none or it is damaged.
+    bool open(const std::string& filename);
+
+    void close();
+
+    // A copy of the thumbnail of a photo, or an empty Mat if it has none, one of a previous version of the
+    // photo, or one that is being rewritten
+    cv::Mat get(const PhotoData& photo) const;
+
+private:
+
+    const unsigned char* data_;
+
+    std::size_t size_;
+
+};
+
+// Makes the thumbnails of all photos that lack an up-to-date one on 'num_threads' threads, resizing the atlas
+// as needed. Returns the number of thumbnails made, or -1 if the atlas cannot be written.
+long buildThumbnails(const PhotoDatabase& db, const std::string& filename, unsigned int num_threads);
+
+// Atlas file of a database file
+std::string thumbnailFilename(const std::string& database_filename);
+
+#endif
@@ -0,0 +1,404 @@
+#include "watcher.h"
+
+#include "photo_database.h"
+#include "dir_walker.h"
+
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+volatile sig_atomic_t stop_requested = 0;
+
+void onSignal(int)
+{
+    stop_requested = 1;
+}
+
+static const uint32_t WATCH_MASK = IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE
+                                   | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+// ----------------------------------------------------------------------------------------------------
+
+bool startsWith(const std::string& s, const std::string& prefix)
+{
+    return s.size() >= prefix.size() && s.compare(0, prefix.size(), prefix) == 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Keeps one inotify watch per directory and turns events into sets of changed files and directories.
+// Directory paths are relative to the image directory and end with a '/' (the root is the empty string).
+
+class Watcher
+{
+
+public:
+
+    Watcher(const std::string& prefix) : fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)), prefix_(prefix),
+        overflow_(false), n_removed_(0)
+    {
+    }
+
+    ~Watcher()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    int fd() const { return fd_; }
+
+    bool hasChanges() const
+    {
+        return overflow_ || n_removed_ > 0 || !changed_files_.empty() || !changed_dirs_.empty()
+                || !moved_from_dirs_.empty();
+    }
+
+    bool overflow() const { return overflow_; }
+
+    // Adds watches for 'rel_dir' and all directories below it
+    void addWatches(const std::string& rel_dir)
+    {
+        std::string abs_dir = prefix_ + rel_dir;
+
+        int wd = inotify_add_watch(fd_, abs_dir.c_str(), WATCH_MASK);
+        if (wd < 0)
+        {
+            if (errno == ENOSPC)
+                std::cout << "Too many directories to watch, raise fs.inotify.max_user_watches" << std::endl;
+            return;
+        }
+
+        // The same directory may have been watched under another name
+        auto it = wd_to_dir_.find(wd);
+        if (it != wd_to_dir_.end())
+            dir_to_wd_.erase(it->second);
+
+        wd_to_dir_[wd] = rel_dir;
+        dir_to_wd_[rel_dir] = wd;
+
+        DIR* dir = opendir(abs_dir.c_str());
+        if (!dir)
+            return;
+
+        std::vector<std::string> subdirs;
+        while(dirent* entry = readdir(dir))
+        {
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                continue;
+
+            bool is_dir = (entry->d_type == DT_DIR);
+            if (entry->d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                is_dir = lstat((abs_dir + name).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+            }
+
+            if (is_dir)
+                subdirs.push_back(rel_dir + name + "/");
+        }
+
+        closedir(dir);
+
+        for(const std::string& subdir : subdirs)
+            addWatches(subdir);
+    }
+
+    // Reads all queued events. Returns false if there were none.
+    bool readEvents()
+    {
+        alignas(inotify_event) char buffer[64 * 1024];
+
+        bool any = false;
+        while(true)
+        {
+            ssize_t n = read(fd_, buffer, sizeof(buffer));
+            if (n <= 0)
+                break;
+
+            for(ssize_t offset = 0; offset < n; )
+            {
+                const inotify_event* event = (const inotify_event*)(buffer + offset);
+                offset += sizeof(inotify_event) + event->len;
+
+                handleEvent(*event);
+                any = true;
+            }
+        }
+
+        return any;
+    }
+
+    // Returns the files that may have changed since the last call, with their current stat. Only to be
+    // called if there was no overflow.
+    void takeChanges(std::vector<PhotoFile>& files)
+    {
+        // Directories that were moved out of the tree
+        for(const auto& m : moved_from_dirs_)
+            removeWatches(m.second);
+
+        for(const std::string& rel_dir : changed_dirs_)
+        {
+            std::vector<PhotoFile> dir_files;
+            findPhotoFiles(prefix_ + rel_dir, 1, dir_files);
+
+            for(PhotoFile& f : dir_files)
+            {
+                f.rel_filename = rel_dir + f.rel_filename;
+                files.push_back(std::move(f));
+            }
+        }
+
+        for(const std::string& rel_filename : changed_files_)
+        {
+            PhotoFile f;
+            if (statFile(prefix_ + rel_filename, f.stat))
+            {
+                f.rel_filename = rel_filename;
+                files.push_back(std::move(f));
+            }
+        }
+
+        std::sort(files.begin(), files.end(),
+                  [](const PhotoFile& a, const PhotoFile& b) { return a.rel_filename < b.rel_filename; });
+        files.erase(std::unique(files.begin(), files.end(),
+                  [](const PhotoFile& a, const PhotoFile& b) { return a.rel_filename == b.rel_filename; }), files.end());
+
+        if (n_removed_ > 0)
+            std::cout << n_removed_ << " photo(s) removed or moved out of the image directory" << std::endl;
+
+        clear();
+    }
+
+    void clear()
+    {
+        changed_files_.clear();
+        changed_dirs_.clear();
+        moved_from_dirs_.clear();
+        n_removed_ = 0;
+        overflow_ = false;
+    }
+
+private:
+
+    int fd_;
+
+    std::string prefix_;
+
+    std::map<int, std::string> wd_to_dir_;
+
+    // Sorted, such that a directory and everything below it form a range
+    std::map<std::string, int> dir_to_wd_;
+
+    std::set<std::string> changed_files_;
+
+    std::set<std::string> changed_dirs_;
+
+    // Directories that were moved away, by inotify cookie. If the matching IN_MOVED_TO arrives, it was a
+    // rename within the tree.
+    std::map<uint32_t, std::string> moved_from_dirs_;
+
+    bool overflow_;
+
+    unsigned int n_removed_;
+
+    void handleEvent(const inotify_event& event)
+    {
+        if (event.mask & IN_Q_OVERFLOW)
+        {
+            overflow_ = true;
+            return;
+        }
+
+        auto it = wd_to_dir_.find(event.wd);
+        if (it == wd_to_dir_.end())
+            return;
+
+        if (event.mask & IN_IGNORED)
+        {
+            // Watched directory was removed
+            dir_to_wd_.erase(it->second);
+            wd_to_dir_.erase(it);
+            return;
+        }
+
+        if (event.len == 0)
+            return;
+
+        std::string path = it->second + event.name;
+
+        if (event.mask & IN_ISDIR)
+        {
+            std::string rel_dir = path + "/";
+
+            if (event.mask & IN_MOVED_FROM)
+            {
+                moved_from_dirs_[event.cookie] = rel_dir;
+            }
+            else if (event.mask & (IN_MOVED_TO | IN_CREATE))
+            {
+                auto m = moved_from_dirs_.find(event.cookie);
+                if ((event.mask & IN_MOVED_TO) && m != moved_from_dirs_.end())
+                {
+                    renameWatches(m->second, rel_dir);
+                    moved_from_dirs_.erase(m);
+                }
+                else
+                {
+                    addWatches(rel_dir);
+                }
+
+                changed_dirs_.insert(rel_dir);
+            }
+        }
+        else if (isPhotoFilename(event.name))
+        {
+            if (event.mask & (IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO))
+            {
+                changed_files_.insert(path);
+            }
+            else if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                changed_files_.erase(path);
+                ++n_removed_;
+            }
+        }
+    }
+
+    void renameWatches(const std::string& from, const std::string& to)
+    {
+        std::vector<std::pair<std::string, int> > moved;
+        for(auto it = dir_to_wd_.lower_bound(from); it != dir_to_wd_.end() && startsWith(it->first, from); )
+        {
+            moved.push_back(*it);
+            it = dir_to_wd_.erase(it);
+        }
+
+        for(const auto& m : moved)
+        {
+            std::string rel_dir = to + m.first.substr(from.size());
+            dir_to_wd_[rel_dir] = m.second;
+            wd_to_dir_[m.second] = rel_dir;
+        }
+    }
+
+    void removeWatches(const std::string& rel_dir)
+    {
+        for(auto it = dir_to_wd_.lower_bound(rel_dir); it != dir_to_wd_.end() && startsWith(it->first, rel_dir); )
+        {
+            inotify_rm_watch(fd_, it->second);
+            wd_to_dir_.erase(it->second);
+            it = dir_to_wd_.erase(it);
+        }
+    }
+
+};
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+void watch(PhotoDatabase& db, const std::string& image_dir, const std::string& database_filename,
+           unsigned int debounce_ms, const ScanOptions& opts)
+{
+    std::string prefix = image_dir;
+    if (prefix.empty() || prefix[prefix.size() - 1] != '/')
+        prefix += '/';
+
+    Watcher watcher(prefix);
+    if (watcher.fd() < 0)
+    {
+        std::cout << "Could not initialize inotify" << std::endl;
+        return;
+    }
+
+    // Watch before scanning, such that nothing that happens during the scan is missed
+    watcher.addWatches("");
+
+    if (!scan(db, image_dir, opts))
+        return;
+
+    saveDatabase(db, database_filename);
+
+    struct sigaction action, old_int, old_term;
+    action.sa_handler = onSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = 0;    // No SA_RESTART: poll() needs to be interrupted
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+
+    std::cout << "Watching '" << image_dir << "' for changes" << std::endl;
+
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point first_change;
+
+    while(!stop_requested)
+    {
+        bool pending = watcher.hasChanges();
+
+        pollfd pfd;
+        pfd.fd = watcher.fd();
+        pfd.events = POLLIN;
+
+        int r = poll(&pfd, 1, pending ? (int)debounce_ms : -1);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (r > 0)
+        {
+            if (watcher.readEvents() && !pending)
+                first_change = Clock::now();
+
+            // Keep collecting while events keep coming, but do not postpone forever
+            if (Clock::now() - first_change < std::chrono::milliseconds(10 * debounce_ms))
+                continue;
+        }
+
+        if (!watcher.hasChanges())
+            continue;
+
+        unsigned long n_updated = 0;
+        if (watcher.overflow())
+        {
+            std::cout << "Too many changes at once, rescanning everything" << std::endl;
+            watcher.clear();
+            watcher.addWatches("");
+            if (scan(db, image_dir, opts))
+                n_updated = 1;
+        }
+        else
+        {
+            std::vector<PhotoFile> files;
+            watcher.takeChanges(files);
+            if (!files.empty())
+                n_updated = scanFiles(db, image_dir, files, opts);
+        }
+
+        if (n_updated > 0)
+            saveDatabase(db, database_filename);
+    }
+
+    sigaction(SIGINT, &old_int, 0);
+    sigaction(SIGTERM, &old_term, 0);
+    stop_requested = 0;
+}
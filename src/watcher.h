@@ -0,0 +1,19 @@
+#ifndef PHOTO_MANAGER_WATCHER_H_
+#define PHOTO_MANAGER_WATCHER_H_
+
+#include <string>
+
+#include "scanner.h"
+
+class PhotoDatabase;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Scans 'image_dir' once, then keeps the database up to date by watching the directory tree with inotify.
+// Events are collected until nothing has happened for 'debounce_ms' milliseconds; the affected files and
+// directories are then re-scanned (moves are recognized by inode, so they are not re-hashed) and, if
+// anything changed, the database is written to 'database_filename'. Returns on SIGINT or SIGTERM.
+void watch(PhotoDatabase& db, const std::string& image_dir, const std::string& database_filename,
+           unsigned int debounce_ms, const ScanOptions& opts = ScanOptions());
+
+#endif